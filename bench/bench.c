@@ -0,0 +1,687 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE thread_t;
+#else
+#include <pthread.h>
+#include <time.h>
+typedef pthread_t thread_t;
+#endif
+
+#include "buddy.h"
+#include "lock.h"
+#include "slab.h"
+
+// Allocator benchmark: throughput and latency percentiles of kmem_cache_alloc, kmalloc, get_buddy and the
+// C library malloc, swept over thread counts, object sizes and alloc/free patterns. Results go out as CSV or JSON.
+
+#define MAX_LIST 32
+#define RING_SIZE 1024
+
+typedef enum allocator_kind {
+	KMEM_CACHE,
+	KMEM_CACHE_BULK,
+	KMALLOC,
+	BUDDY,
+	LIBC_MALLOC,
+	ALLOCATOR_NUMBER
+} allocator_kind;
+
+typedef enum pattern_kind {
+	LIFO,
+	FIFO,
+	RANDOM,
+	PRODUCER_CONSUMER,
+	PATTERN_NUMBER
+} pattern_kind;
+
+static const char* allocator_names[] = { "kmem_cache", "kmem_cache_bulk", "kmalloc", "buddy", "malloc" };
+static const char* pattern_names[] = { "lifo", "fifo", "random", "producer_consumer" };
+
+typedef struct config {
+	int threads[MAX_LIST];
+	int thread_cnt;
+	int sizes[MAX_LIST];
+	int size_cnt;
+	int allocators[ALLOCATOR_NUMBER];
+	int patterns[PATTERN_NUMBER];
+	int ops;		// allocations per thread
+	int window;		// objects a thread keeps live before it starts freeing
+	int sample_every;	// time every n-th operation of the latency pass
+	size_t blocks;
+	int mmap_arena;		// kmem_init_arena instead of a malloc'd arena
+	unsigned arena_flags;
+	int release_order;
+	int json;
+	const char* label;
+	FILE* out;
+} Config;
+
+typedef struct ring {
+	void* slots[RING_SIZE];
+	volatile int head;
+	volatile int tail;
+} Ring;
+
+typedef struct worker {
+	int id;
+	allocator_kind allocator;
+	pattern_kind pattern;
+	int size;
+	kmem_cache_t* cache;
+	Ring* ring;		// producer/consumer pairs share one ring
+	volatile int* start;
+	unsigned seed;
+	int sample_every;	// 0 in the throughput pass, which reads no clock
+
+	long long* alloc_latencies;
+	long long* free_latencies;
+	int alloc_samples;
+	int free_samples;
+	int failures;
+	int ops;
+} Worker;
+
+typedef struct result {
+	double seconds;
+	long long ops;
+	long long failures;
+	long long alloc_percentiles[3];
+	long long free_percentiles[3];
+} Result;
+
+static Config config;
+
+
+// -------------------------------------------------------------------------------------------------------------------------------
+
+
+static long long now_ns() {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if (!frequency.QuadPart) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+	return (long long)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+static unsigned next_random(unsigned* seed) {
+	*seed = *seed * 1103515245u + 12345u;
+	return *seed >> 8;
+}
+
+static int blocks_for(int size) {
+	return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static void* bench_alloc(Worker* worker) {
+	void* obj = NULL;
+	switch (worker->allocator) {
+	case KMEM_CACHE:
+	case KMEM_CACHE_BULK:
+		obj = kmem_cache_alloc(worker->cache);
+		break;
+	case KMALLOC:
+		obj = kmalloc(worker->size);
+		break;
+	case BUDDY:
+		obj = get_buddy(blocks_for(worker->size));
+		break;
+	default:
+		obj = malloc(worker->size);
+		break;
+	}
+	if (obj) {
+		*(volatile char*)obj = (char)worker->id;
+	}
+	return obj;
+}
+
+static void bench_free(Worker* worker, void* obj) {
+	switch (worker->allocator) {
+	case KMEM_CACHE:
+	case KMEM_CACHE_BULK:
+		kmem_cache_free(worker->cache, obj);
+		break;
+	case KMALLOC:
+		kfree(obj);
+		break;
+	case BUDDY:
+		put_buddy((Block*)obj, blocks_for(worker->size));
+		break;
+	default:
+		free(obj);
+		break;
+	}
+}
+
+static void* timed_alloc(Worker* worker, int op) {
+	if (!worker->sample_every || op % worker->sample_every) {
+		return bench_alloc(worker);
+	}
+	long long start = now_ns();
+	void* obj = bench_alloc(worker);
+	worker->alloc_latencies[worker->alloc_samples++] = now_ns() - start;
+	return obj;
+}
+
+static void timed_free(Worker* worker, void* obj, int op) {
+	if (!worker->sample_every || op % worker->sample_every) {
+		bench_free(worker, obj);
+		return;
+	}
+	long long start = now_ns();
+	bench_free(worker, obj);
+	worker->free_latencies[worker->free_samples++] = now_ns() - start;
+}
+
+
+// -------------------------------------------------------------------------------------------------------------------------------
+
+
+static void ring_push(Ring* ring, void* obj) {
+	int head = ring->head;
+	while (head - atomic_fetch_add_int(&ring->tail, 0) == RING_SIZE) {
+		thread_yield();
+	}
+	ring->slots[head % RING_SIZE] = obj;
+	atomic_fetch_add_int(&ring->head, 1);
+}
+
+static void* ring_pop(Ring* ring) {
+	int tail = ring->tail;
+	while (atomic_fetch_add_int(&ring->head, 0) == tail) {
+		thread_yield();
+	}
+	void* obj = ring->slots[tail % RING_SIZE];
+	atomic_fetch_add_int(&ring->tail, 1);
+	return obj;
+}
+
+// The whole window is allocated and freed with one call each, every object is charged the average cost of the call
+static int bulk_alloc(Worker* worker, void** live, int count) {
+	long long start = worker->sample_every ? now_ns() : 0;
+	int allocated = kmem_cache_alloc_bulk(worker->cache, live, count);
+	if (worker->sample_every) {
+		worker->alloc_latencies[worker->alloc_samples++] = (now_ns() - start) / (count ? count : 1);
+	}
+	for (int i = 0; i < allocated; i++) {
+		*(volatile char*)live[i] = (char)worker->id;
+	}
+	worker->failures += count - allocated;
+	return allocated;
+}
+
+static void bulk_free(Worker* worker, void** live, int count) {
+	long long start = worker->sample_every ? now_ns() : 0;
+	kmem_cache_free_bulk(worker->cache, live, count);
+	if (worker->sample_every) {
+		worker->free_latencies[worker->free_samples++] = (now_ns() - start) / (count ? count : 1);
+	}
+}
+
+static void reverse(void** live, int count) {
+	for (int i = 0, j = count - 1; i < j; i++, j--) {
+		void* tmp = live[i];
+		live[i] = live[j];
+		live[j] = tmp;
+	}
+}
+
+static void run_window_pattern(Worker* worker, void** live) {
+	int op = 0;
+	while (op < worker->ops) {
+		int count = worker->ops - op < config.window ? worker->ops - op : config.window;
+
+		int allocated = 0;
+		for (int i = 0; i < count && worker->allocator != KMEM_CACHE_BULK; i++) {
+			void* obj = timed_alloc(worker, op + i);
+			if (!obj) {
+				worker->failures++;
+				continue;
+			}
+			live[allocated++] = obj;
+		}
+
+		if (worker->allocator == KMEM_CACHE_BULK) {
+			allocated = bulk_alloc(worker, live, count);
+		}
+
+		if (worker->pattern == RANDOM) {
+			for (int i = allocated - 1; i > 0; i--) {
+				int j = next_random(&worker->seed) % (i + 1);
+				void* tmp = live[i];
+				live[i] = live[j];
+				live[j] = tmp;
+			}
+		}
+
+		if (worker->allocator == KMEM_CACHE_BULK) {
+			if (worker->pattern == LIFO) {
+				reverse(live, allocated);
+			}
+			bulk_free(worker, live, allocated);
+		}
+		for (int i = 0; i < allocated && worker->allocator != KMEM_CACHE_BULK; i++) {
+			int index = worker->pattern == LIFO ? allocated - 1 - i : i;
+			timed_free(worker, live[index], op + i);
+		}
+		op += count;
+	}
+}
+
+static void run_producer(Worker* worker) {
+	for (int op = 0; op < worker->ops; op++) {
+		void* obj = timed_alloc(worker, op);
+		if (!obj) {
+			worker->failures++;
+		}
+		ring_push(worker->ring, obj);
+	}
+}
+
+static void run_consumer(Worker* worker) {
+	for (int op = 0; op < worker->ops; op++) {
+		void* obj = ring_pop(worker->ring);
+		if (obj) {
+			timed_free(worker, obj, op);
+		}
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(void* arg) {
+#else
+static void* worker_main(void* arg) {
+#endif
+	Worker* worker = (Worker*)arg;
+	void** live = (void**)malloc(sizeof(void*) * config.window);
+
+	while (!atomic_load_int(worker->start)) {
+		cpu_relax();
+	}
+
+	if (worker->pattern != PRODUCER_CONSUMER) {
+		run_window_pattern(worker, live);
+	}
+	else if (worker->id % 2 == 0) {
+		run_producer(worker);
+	}
+	else {
+		run_consumer(worker);
+	}
+
+	free(live);
+	return 0;
+}
+
+
+// -------------------------------------------------------------------------------------------------------------------------------
+
+
+static int compare_latencies(const void* a, const void* b) {
+	long long x = *(const long long*)a, y = *(const long long*)b;
+	return (x > y) - (x < y);
+}
+
+static void percentiles(long long* samples, long long count, long long* out) {
+	static const double points[3] = { 0.50, 0.99, 0.999 };
+	if (!count) {
+		out[0] = out[1] = out[2] = 0;
+		return;
+	}
+	qsort(samples, (size_t)count, sizeof(long long), compare_latencies);
+	for (int i = 0; i < 3; i++) {
+		long long index = (long long)(points[i] * (double)(count - 1));
+		out[i] = samples[index];
+	}
+}
+
+// Runs every worker once over the same arena and cache, returns the wall time in ns
+static long long run_pass(Worker* workers, int threads, int sample_every) {
+
+	volatile int start = 0;
+	thread_t* handles = (thread_t*)malloc(sizeof(thread_t) * threads);
+	for (int i = 0; i < threads; i++) {
+		Worker* worker = &workers[i];
+		worker->start = &start;
+		worker->seed = 12345u + i;
+		worker->sample_every = sample_every;
+		worker->alloc_samples = worker->free_samples = 0;
+		worker->failures = 0;
+#ifdef _WIN32
+		handles[i] = CreateThread(NULL, 0, worker_main, worker, 0, NULL);
+#else
+		pthread_create(&handles[i], NULL, worker_main, worker);
+#endif
+	}
+
+	long long begin = now_ns();
+	atomic_exchange_int(&start, 1);
+	for (int i = 0; i < threads; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(handles[i], INFINITE);
+		CloseHandle(handles[i]);
+#else
+		pthread_join(handles[i], NULL);
+#endif
+	}
+	long long end = now_ns();
+
+	free(handles);
+	return end - begin;
+}
+
+static int run_case(allocator_kind allocator, pattern_kind pattern, int threads, int size, Result* result) {
+
+	if (pattern == PRODUCER_CONSUMER && (threads < 2 || allocator == KMEM_CACHE_BULK)) {
+		return 0;
+	}
+	if (pattern == PRODUCER_CONSUMER) {
+		threads -= threads % 2;
+	}
+
+	void* space = NULL;
+	kmem_cache_t* cache = NULL;
+	if (allocator != LIBC_MALLOC && config.mmap_arena) {
+		if (kmem_init_arena(config.blocks, config.arena_flags, config.release_order)) {
+			exit(1);
+		}
+	}
+	else if (allocator != LIBC_MALLOC) {
+		space = malloc((size_t)BLOCK_SIZE * config.blocks);
+		if (!space) {
+			fprintf(stderr, "Cannot allocate a %zu block arena\n", config.blocks);
+			exit(1);
+		}
+		kmem_init(space, config.blocks);
+	}
+	if (allocator != LIBC_MALLOC) {
+		if (allocator == KMEM_CACHE || allocator == KMEM_CACHE_BULK) {
+			cache = kmem_cache_create("bench", size, NULL, NULL);
+		}
+	}
+
+	Worker* workers = (Worker*)calloc(threads, sizeof(Worker));
+	Ring* rings = (Ring*)calloc(threads / 2 + 1, sizeof(Ring));
+	// The bulk allocator times every window
+	int samples = config.ops / (config.sample_every < config.window ? config.sample_every : config.window) + 1;
+
+	for (int i = 0; i < threads; i++) {
+		Worker* worker = &workers[i];
+		worker->id = i;
+		worker->allocator = allocator;
+		worker->pattern = pattern;
+		worker->size = size;
+		worker->cache = cache;
+		worker->ring = &rings[i / 2];
+		worker->ops = config.ops;
+		worker->alloc_latencies = (long long*)malloc(sizeof(long long) * samples);
+		worker->free_latencies = (long long*)malloc(sizeof(long long) * samples);
+	}
+
+	// Throughput comes from a pass that reads no clock, the latencies from a second one that times every
+	// sample_every-th operation, so neither the clock reads nor the sample stores are counted as allocator time
+	long long elapsed = run_pass(workers, threads, 0);
+	long long failures = 0;
+	for (int i = 0; i < threads; i++) {
+		failures += workers[i].failures;
+	}
+	run_pass(workers, threads, config.sample_every);
+
+	long long alloc_total = 0, free_total = 0;
+	for (int i = 0; i < threads; i++) {
+		alloc_total += workers[i].alloc_samples;
+		free_total += workers[i].free_samples;
+	}
+	long long* alloc_latencies = (long long*)malloc(sizeof(long long) * (alloc_total + 1));
+	long long* free_latencies = (long long*)malloc(sizeof(long long) * (free_total + 1));
+	long long alloc_at = 0, free_at = 0;
+
+	result->seconds = (double)elapsed / 1e9;
+	result->ops = 0;
+	result->failures = failures;
+	for (int i = 0; i < threads; i++) {
+		Worker* worker = &workers[i];
+		memcpy(alloc_latencies + alloc_at, worker->alloc_latencies, sizeof(long long) * worker->alloc_samples);
+		memcpy(free_latencies + free_at, worker->free_latencies, sizeof(long long) * worker->free_samples);
+		alloc_at += worker->alloc_samples;
+		free_at += worker->free_samples;
+		// An operation is one allocation or one free
+		result->ops += pattern == PRODUCER_CONSUMER ? worker->ops : 2LL * worker->ops;
+		free(worker->alloc_latencies);
+		free(worker->free_latencies);
+	}
+	percentiles(alloc_latencies, alloc_total, result->alloc_percentiles);
+	percentiles(free_latencies, free_total, result->free_percentiles);
+
+	free(alloc_latencies);
+	free(free_latencies);
+	free(rings);
+	free(workers);
+	if (cache) {
+		kmem_cache_destroy(cache);
+	}
+	if (allocator != LIBC_MALLOC && config.mmap_arena) {
+		kmem_release_arena();
+	}
+	free(space);
+	return threads;
+}
+
+
+// -------------------------------------------------------------------------------------------------------------------------------
+
+
+static int parse_list(const char* arg, int* out) {
+	int count = 0;
+	const char* p = arg;
+	while (*p && count < MAX_LIST) {
+		out[count++] = atoi(p);
+		while (*p && *p != ',') {
+			p++;
+		}
+		if (*p == ',') {
+			p++;
+		}
+	}
+	return count;
+}
+
+static void parse_names(const char* arg, const char** names, int number, int* enabled) {
+	memset(enabled, 0, sizeof(int) * number);
+	for (int i = 0; i < number; i++) {
+		const char* found = strstr(arg, names[i]);
+		size_t length = strlen(names[i]);
+		while (found) {
+			int starts = found == arg || found[-1] == ',';
+			int ends = found[length] == '\0' || found[length] == ',';
+			if (starts && ends) {
+				enabled[i] = 1;
+				break;
+			}
+			found = strstr(found + 1, names[i]);
+		}
+	}
+}
+
+static void usage(const char* program) {
+	printf("Usage: %s [options]\n", program);
+	printf("  --threads 1,2,4,8          thread counts to sweep\n");
+	printf("  --sizes 16,64,256,1024     object sizes in bytes (buddy rounds them up to blocks)\n");
+	printf("  --allocators kmem_cache,kmem_cache_bulk,kmalloc,buddy,malloc\n");
+	printf("  --patterns lifo,fifo,random,producer_consumer\n");
+	printf("  --ops N                    allocations per thread (default 200000)\n");
+	printf("  --window N                 live objects per thread before freeing (default 256)\n");
+	printf("  --sample N                 time every N-th operation of the latency pass, throughput is measured\n");
+	printf("                             in a separate untimed pass (default 100)\n");
+	printf("  --blocks N                 arena size in %d byte blocks (default 65536)\n", BLOCK_SIZE);
+	printf("  --arena malloc|mmap|huge   where the arena comes from (default malloc)\n");
+	printf("  --release ORDER            with an mmap arena, free runs of 2^ORDER blocks go back to the OS (default -1, never)\n");
+	printf("  --format csv|json          output format (default csv)\n");
+	printf("  --label NAME               value of the label column, e.g. a commit id\n");
+	printf("  --out FILE                 write results to FILE instead of stdout\n");
+}
+
+static void parse_arguments(int argc, char** argv) {
+
+	config.thread_cnt = parse_list("1,2,4,8", config.threads);
+	config.size_cnt = parse_list("16,64,256,1024", config.sizes);
+	for (int i = 0; i < ALLOCATOR_NUMBER; i++) {
+		config.allocators[i] = 1;
+	}
+	for (int i = 0; i < PATTERN_NUMBER; i++) {
+		config.patterns[i] = 1;
+	}
+	config.ops = 200000;
+	config.window = 256;
+	config.sample_every = 100;
+	config.blocks = 65536;
+	config.mmap_arena = 0;
+	config.arena_flags = 0;
+	config.release_order = -1;
+	config.json = 0;
+	config.label = "";
+	config.out = stdout;
+
+	for (int i = 1; i < argc; i++) {
+		const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (!strcmp(argv[i], "--help") || !value) {
+			usage(argv[0]);
+			exit(strcmp(argv[i], "--help") ? 1 : 0);
+		}
+		if (!strcmp(argv[i], "--threads")) {
+			config.thread_cnt = parse_list(value, config.threads);
+		}
+		else if (!strcmp(argv[i], "--sizes")) {
+			config.size_cnt = parse_list(value, config.sizes);
+		}
+		else if (!strcmp(argv[i], "--allocators")) {
+			parse_names(value, allocator_names, ALLOCATOR_NUMBER, config.allocators);
+		}
+		else if (!strcmp(argv[i], "--patterns")) {
+			parse_names(value, pattern_names, PATTERN_NUMBER, config.patterns);
+		}
+		else if (!strcmp(argv[i], "--ops")) {
+			config.ops = atoi(value);
+		}
+		else if (!strcmp(argv[i], "--window")) {
+			config.window = atoi(value);
+		}
+		else if (!strcmp(argv[i], "--sample")) {
+			config.sample_every = atoi(value);
+		}
+		else if (!strcmp(argv[i], "--blocks")) {
+			config.blocks = (size_t)strtoull(value, NULL, 10);
+		}
+		else if (!strcmp(argv[i], "--arena")) {
+			config.mmap_arena = strcmp(value, "malloc") != 0;
+			config.arena_flags = !strcmp(value, "huge") ? KMEM_ARENA_HUGE_PAGES : 0;
+		}
+		else if (!strcmp(argv[i], "--release")) {
+			config.release_order = atoi(value);
+		}
+		else if (!strcmp(argv[i], "--format")) {
+			config.json = !strcmp(value, "json");
+		}
+		else if (!strcmp(argv[i], "--label")) {
+			config.label = value;
+		}
+		else if (!strcmp(argv[i], "--out")) {
+			config.out = fopen(value, "w");
+			if (!config.out) {
+				fprintf(stderr, "Cannot open %s\n", value);
+				exit(1);
+			}
+		}
+		else {
+			usage(argv[0]);
+			exit(1);
+		}
+		i++;
+	}
+
+	if (config.ops < 1 || config.window < 1 || config.sample_every < 1) {
+		fprintf(stderr, "--ops, --window and --sample must be positive\n");
+		exit(1);
+	}
+}
+
+static void print_result(allocator_kind allocator, pattern_kind pattern, int threads, int size, Result* result, int first) {
+	double ops_per_second = result->seconds > 0 ? (double)result->ops / result->seconds : 0;
+
+	if (config.json) {
+		fprintf(config.out, "%s  {\"label\": \"%s\", \"allocator\": \"%s\", \"pattern\": \"%s\", \"threads\": %d, \"size\": %d, "
+			"\"ops\": %lld, \"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+			"\"alloc_p50_ns\": %lld, \"alloc_p99_ns\": %lld, \"alloc_p999_ns\": %lld, "
+			"\"free_p50_ns\": %lld, \"free_p99_ns\": %lld, \"free_p999_ns\": %lld, \"failures\": %lld}",
+			first ? "" : ",\n", config.label, allocator_names[allocator], pattern_names[pattern], threads, size,
+			result->ops, result->seconds, ops_per_second,
+			result->alloc_percentiles[0], result->alloc_percentiles[1], result->alloc_percentiles[2],
+			result->free_percentiles[0], result->free_percentiles[1], result->free_percentiles[2], result->failures);
+	}
+	else {
+		fprintf(config.out, "%s,%s,%s,%d,%d,%lld,%.6f,%.0f,%lld,%lld,%lld,%lld,%lld,%lld,%lld\n",
+			config.label, allocator_names[allocator], pattern_names[pattern], threads, size,
+			result->ops, result->seconds, ops_per_second,
+			result->alloc_percentiles[0], result->alloc_percentiles[1], result->alloc_percentiles[2],
+			result->free_percentiles[0], result->free_percentiles[1], result->free_percentiles[2], result->failures);
+	}
+	fflush(config.out);
+}
+
+int main(int argc, char** argv) {
+
+	parse_arguments(argc, argv);
+
+	if (config.json) {
+		fprintf(config.out, "[\n");
+	}
+	else {
+		fprintf(config.out, "label,allocator,pattern,threads,size,ops,seconds,ops_per_sec,"
+			"alloc_p50_ns,alloc_p99_ns,alloc_p999_ns,free_p50_ns,free_p99_ns,free_p999_ns,failures\n");
+	}
+
+	int first = 1;
+	for (int a = 0; a < ALLOCATOR_NUMBER; a++) {
+		if (!config.allocators[a]) {
+			continue;
+		}
+		for (int p = 0; p < PATTERN_NUMBER; p++) {
+			if (!config.patterns[p]) {
+				continue;
+			}
+			for (int t = 0; t < config.thread_cnt; t++) {
+				for (int s = 0; s < config.size_cnt; s++) {
+					Result result;
+					int threads = run_case((allocator_kind)a, (pattern_kind)p, config.threads[t], config.sizes[s], &result);
+					if (!threads) {
+						continue;
+					}
+					print_result((allocator_kind)a, (pattern_kind)p, threads, config.sizes[s], &result, first);
+					first = 0;
+				}
+			}
+		}
+	}
+
+	if (config.json) {
+		fprintf(config.out, "\n]\n");
+	}
+	if (config.out != stdout) {
+		fclose(config.out);
+	}
+
+	// Only prints when the library was built with MEMORY_ALLOCATOR_LOCK_STATS
+	lock_stats_print(stderr);
+	return 0;
+}
@@ -1,24 +1,93 @@
 #pragma once
 
+#include "lock.h"
 #include "slab.h"
-#include <Windows.h>
 
-#define block_offset_bit_cnt 12
+#define BLOCK_FREE (0x80)
+#define BUDDY_MAX_SHARDS 64
+#define BUDDY_MIN_SHARD_BLOCKS 4096	// 16 MiB, smaller shards would cap the largest allocation too early
+#define PAGE_CACHE_MAX_ORDER 1		// runs of 1 and 2 blocks are cached per processor
+#define PAGE_CACHE_MAX_NUMBER 64
+#define PAGE_CACHE_HIGH 64		// runs of one order a page cache holds before it gives a batch back
 
 typedef union BuddyUnion {
-	union BuddyUnion* next;
+	struct {
+		union BuddyUnion* next;
+		union BuddyUnion* prev;
+	};
 	char data[BLOCK_SIZE];
 } Block;
 
-typedef struct BuddyManager {
-	int number_of_blocks;
+// An independent buddy allocator over a contiguous part of the arena, runs never merge across shards
+typedef struct BuddyShard {
+	Mutex mutex;
+	size_t first_block;			// offset of the shard in the arena
+	size_t number_of_blocks;
 	int largest_block_degree2;
-	Block* starting_block_adr;
+	volatile unsigned long long nonempty_orders;	// bit i set <=> headers[i] is not empty
 	Block* headers[64];
-	HANDLE dhMutex;
+	volatile unsigned long long free_runs[64];	// statistics, written under the mutex and read without it
+	volatile unsigned long long splits[64];		// runs of order i split in two
+	volatile unsigned long long merges[64];		// pairs of order i buddies merged
+} BuddyShard;
+
+// Runs of order <= PAGE_CACHE_MAX_ORDER kept out of the shards, so most slab grows and shrinks neither lock a shard
+// nor split and merge. Cached runs look allocated to the shards. Lists are hot at the head, drained from the tail.
+typedef struct PageCache {
+	SpinLock lock;
+	Block* head[PAGE_CACHE_MAX_ORDER + 1];
+	Block* tail[PAGE_CACHE_MAX_ORDER + 1];
+	volatile int count[PAGE_CACHE_MAX_ORDER + 1];
+} PageCache;
+
+typedef struct BuddyManager {
+	size_t number_of_blocks;
+	int largest_block_degree2;		// of the largest shard
+	Block* starting_block_adr;
+	unsigned char* block_state;		// BLOCK_FREE | order for the first block of every free run, 0 otherwise
+	size_t shard_size;			// every shard but the last one has this many blocks
+	int number_of_shards;
+	BuddyShard shards[BUDDY_MAX_SHARDS];
+	int release_order;			// free runs that coalesce to this order or above go back to the OS, -1 never
+	int release_lazy;
+	size_t release_granule;			// bytes, released ranges are trimmed to whole granules
+	volatile unsigned long long released_blocks;
+	int page_cache_high;			// 0 when the arena is too small to spare blocks for the page caches
+	int page_cache_batch;			// runs moved between a page cache and the shards at once
+	int number_of_page_caches;
+	PageCache page_caches[PAGE_CACHE_MAX_NUMBER];
 } BuddyManager;
 
-void init_buddy_manager(void* space, int block_num);
+typedef struct BuddyOrderStats {
+	unsigned long long free_blocks;		// free runs of 2^order blocks
+	unsigned long long splits;
+	unsigned long long merges;
+} BuddyOrderStats;
+
+// Summed over all shards, every counter is read on its own so the snapshot is not atomic as a whole
+typedef struct BuddyStats {
+	size_t number_of_blocks;
+	size_t free_blocks;
+	size_t cached_blocks;			// held by the page caches, not counted in free_blocks
+	unsigned long long released_blocks;	// handed back to the OS so far, counted again every time they are reused and freed
+	int largest_block_degree2;
+	int number_of_shards;
+	BuddyOrderStats orders[64];
+} BuddyStats;
+
+// Sizes are in blocks, block offsets are relative to starting_block_adr.
+// shard_num 0 picks one shard per processor, as long as every shard keeps BUDDY_MIN_SHARD_BLOCKS.
+// The first block and every shard start at a multiple of alignment bytes (a power of two, BLOCK_SIZE for none), so
+// runs of that size are aligned in memory too. space must be block aligned.
+void init_buddy_manager(void* space, size_t block_num, size_t client_size, int shard_num, size_t alignment);
+void attach_buddy_manager(void* space);	// adopts a manager init_buddy_manager built at space in another process
 BuddyManager* get_buddy_manager();
 void print_buddy_manager();
-void put_buddy(Block* block, int size_of_block);
\ No newline at end of file
+void get_buddy_stats(BuddyStats* stats);
+Block* get_buddy(size_t size);
+int buddy_has_free_run(size_t size);
+void put_buddy(Block* block, size_t size_of_block);
+void buddy_drain_page_caches();	// gives every cached run back to its shard
+// Only for arenas mapped with vm_reserve. The first block of a released run keeps the free list links, the rest
+// reads back as zeros, or as whatever it held for a lazy release.
+void buddy_set_release(int order, size_t granule, int lazy);
\ No newline at end of file
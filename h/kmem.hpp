@@ -0,0 +1,262 @@
+#pragma once
+
+// Header-only C++17 layer over slab.h:
+// object_cache<T> - slab cache of constructed T objects, T's default constructor and destructor are the cache ctor
+//                   and dtor, so they run once per object per slab rather than on every allocation.
+// allocator<T> - standard allocator, single objects (the nodes of maps, sets and lists) come from a cache of their
+//                size and alignment, arrays from kmalloc.
+// kmalloc_memory_resource() - std::pmr::memory_resource over kmalloc and its size classes, requests aligned to more
+//                             than kmalloc guarantees come from caches of the same classes with that alignment.
+// Everything lives in the arena of kmem_init, which has to outlive the objects and containers using it. The caches of
+// allocator<T> and of over-aligned requests are created on first use and kept for the rest of the process, so
+// kmem_init runs once per process.
+
+#include "size_classes.h"
+#include "slab.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <new>
+#include <type_traits>
+#include <utility>
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define KMEM_HAS_MEMORY_RESOURCE 1
+#endif
+
+namespace kmem {
+
+namespace detail {
+
+constexpr std::size_t natural_alignment_max = 2 * sizeof(void*);
+
+constexpr int log2_of(std::size_t power_of_two) {
+	int log = 0;
+	while (power_of_two > 1) {
+		power_of_two >>= 1;
+		log++;
+	}
+	return log;
+}
+
+// One row per alignment above natural_alignment_max up to a block, one column per kmalloc size class
+constexpr int aligned_cache_rows = log2_of(BLOCK_SIZE) - log2_of(natural_alignment_max);
+inline std::atomic<kmem_cache_t*> aligned_caches[aligned_cache_rows][NUMBER_OF_SIZE_CLASSES];
+
+inline std::atomic<kmem_cache_t*>& aligned_cache_slot(std::size_t bytes, std::size_t align) noexcept {
+	return aligned_caches[log2_of(align) - log2_of(natural_alignment_max) - 1][size_class_of(bytes)];
+}
+
+// Objects of the kmalloc class of bytes, aligned to align. Threads racing to create it keep the first one.
+inline kmem_cache_t* aligned_cache(std::size_t bytes, std::size_t align) noexcept {
+	std::atomic<kmem_cache_t*>& slot = aligned_cache_slot(bytes, align);
+	kmem_cache_t* cache = slot.load(std::memory_order_acquire);
+	if (cache) {
+		return cache;
+	}
+
+	int size = size_class_sizes[size_class_of(bytes)];
+	char name[30];
+	std::snprintf(name, sizeof(name), "kmem::aligned<%d,%zu>", size, align);
+	kmem_cache_t* created = kmem_cache_create_aligned(name, size, align, nullptr, nullptr, 0);
+	if (!created) {
+		return nullptr;
+	}
+	if (!slot.compare_exchange_strong(cache, created, std::memory_order_acq_rel)) {
+		kmem_cache_destroy(created);
+		return cache;
+	}
+	return created;
+}
+
+// kmalloc aligns a buffer to the largest power of two dividing its size class, up to natural_alignment_max, and a
+// large buffer to a block. Rounding the size up to the alignment picks a class that is a multiple of it, stricter
+// alignments of small sizes take a cache of the same class with that alignment.
+inline void* allocate_bytes(std::size_t bytes, std::size_t align) noexcept {
+	if (align > BLOCK_SIZE) {
+		return nullptr;
+	}
+	if (!bytes) {
+		bytes = 1;
+	}
+	if (bytes > KMALLOC_MAX_CACHE_SIZE) {
+		return kmalloc(bytes);
+	}
+	if (align <= natural_alignment_max) {
+		return kmalloc((bytes + align - 1) & ~(align - 1));
+	}
+	kmem_cache_t* cache = aligned_cache(bytes, align);
+	return cache ? kmem_cache_alloc(cache) : nullptr;
+}
+
+// Takes the size and alignment the memory was allocated with
+inline void deallocate_bytes(void* memory, std::size_t bytes, std::size_t align) noexcept {
+	if (!bytes) {
+		bytes = 1;
+	}
+	if (bytes > KMALLOC_MAX_CACHE_SIZE || align <= natural_alignment_max) {
+		kfree(memory);
+		return;
+	}
+	kmem_cache_free(aligned_cache_slot(bytes, align).load(std::memory_order_acquire), memory);
+}
+
+// One cache per node size and alignment, shared by every allocator<T> with that layout
+template <std::size_t Size, std::size_t Align>
+kmem_cache_t* node_cache() {
+	static kmem_cache_t* const cache = [] {
+		char name[30];
+		std::snprintf(name, sizeof(name), "kmem::allocator<%zu,%zu>", Size, Align);
+		return kmem_cache_create_aligned(name, Size, Align, nullptr, nullptr, 0);
+	}();
+	if (!cache) {
+		throw std::bad_alloc();
+	}
+	return cache;
+}
+
+}
+
+template <class T>
+class object_cache {
+	static_assert(alignof(T) <= BLOCK_SIZE, "slab objects are aligned to at most a block");
+	static_assert(std::is_nothrow_default_constructible_v<T> && std::is_nothrow_destructible_v<T>,
+		"the cache ctor and dtor run inside the allocator and cannot throw");
+
+	static void construct(void* object) noexcept {
+		::new (object) T();
+	}
+
+	static void destroy(void* object) noexcept {
+		static_cast<T*>(object)->~T();
+	}
+
+	// Trivial ones are left out, so the cache can share slabs with other caches of the same size
+	static constexpr void(*ctor)(void*) = std::is_trivially_default_constructible_v<T> ? nullptr : &construct;
+	static constexpr void(*dtor)(void*) = std::is_trivially_destructible_v<T> ? nullptr : &destroy;
+
+public:
+	static constexpr std::size_t object_size = sizeof(T);
+	static constexpr std::size_t object_align = alignof(T);
+
+	explicit object_cache(const char* name, unsigned flags = 0)
+		: cache_(kmem_cache_create_aligned(name, object_size, object_align, ctor, dtor, flags)) {
+		if (!cache_) {
+			throw std::bad_alloc();
+		}
+	}
+
+	~object_cache() {
+		if (cache_) {
+			kmem_cache_destroy(cache_);
+		}
+	}
+
+	object_cache(const object_cache&) = delete;
+	object_cache& operator=(const object_cache&) = delete;
+
+	object_cache(object_cache&& other) noexcept : cache_(std::exchange(other.cache_, nullptr)) {}
+
+	object_cache& operator=(object_cache&& other) noexcept {
+		std::swap(cache_, other.cache_);
+		return *this;
+	}
+
+	// Constructed already, in the state the previous user freed it in
+	T* allocate() {
+		void* object = kmem_cache_alloc(cache_);
+		if (!object) {
+			throw std::bad_alloc();
+		}
+		return std::launder(static_cast<T*>(object));
+	}
+
+	// Without destroying it, the next allocate hands it out as it is
+	void deallocate(T* object) noexcept {
+		kmem_cache_free(cache_, object);
+	}
+
+	int shrink() noexcept {
+		return kmem_cache_shrink(cache_);
+	}
+
+	kmem_cache_t* get() const noexcept {
+		return cache_;
+	}
+
+private:
+	kmem_cache_t* cache_;
+};
+
+template <class T>
+class allocator {
+public:
+	using value_type = T;
+
+	allocator() noexcept = default;
+
+	template <class U>
+	allocator(const allocator<U>&) noexcept {}
+
+	T* allocate(std::size_t n) {
+		void* memory;
+		if (n == 1) {
+			memory = kmem_cache_alloc(detail::node_cache<sizeof(T), alignof(T)>());
+		}
+		else {
+			memory = n > static_cast<std::size_t>(-1) / sizeof(T) ? nullptr : detail::allocate_bytes(n * sizeof(T), alignof(T));
+		}
+		if (!memory) {
+			throw std::bad_alloc();
+		}
+		return static_cast<T*>(memory);
+	}
+
+	void deallocate(T* memory, std::size_t n) noexcept {
+		if (n == 1) {
+			kmem_cache_free(detail::node_cache<sizeof(T), alignof(T)>(), memory);
+		}
+		else {
+			detail::deallocate_bytes(memory, n * sizeof(T), alignof(T));
+		}
+	}
+};
+
+template <class T, class U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept {
+	return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept {
+	return false;
+}
+
+#ifdef KMEM_HAS_MEMORY_RESOURCE
+class kmalloc_resource final : public std::pmr::memory_resource {
+private:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+		void* memory = detail::allocate_bytes(bytes, alignment);
+		if (!memory) {
+			throw std::bad_alloc();
+		}
+		return memory;
+	}
+
+	void do_deallocate(void* memory, std::size_t bytes, std::size_t alignment) override {
+		detail::deallocate_bytes(memory, bytes, alignment);
+	}
+
+	// Every instance hands out and takes back the same buffers
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+		return dynamic_cast<const kmalloc_resource*>(&other) != nullptr;
+	}
+};
+
+inline std::pmr::memory_resource* kmalloc_memory_resource() noexcept {
+	static kmalloc_resource resource;
+	return &resource;
+}
+#endif
+
+}
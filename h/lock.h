@@ -0,0 +1,254 @@
+#pragma once
+
+// Allocator internal synchronization.
+// Mutex - adaptive lock, spins for a while and then sleeps on the lock word (futex on Linux, WaitOnAddress on Windows).
+// SpinLock - plain test-and-test-and-set lock for critical sections of a few instructions.
+// Neither lock is recursive. Both work across processes on shared memory once lock_set_process_shared(1) was called,
+// which only matters for sleeping and waking up Mutex waiters.
+// Building with LOCK_STATS records acquisitions, contention, wait and hold times for every call site that takes a lock,
+// lock_stats_print dumps them. Without it the instrumentation compiles to nothing.
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <intrin.h>
+#define THREAD_LOCAL __declspec(thread)
+typedef HANDLE Thread;
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#define THREAD_LOCAL __thread
+typedef pthread_t Thread;
+#endif
+
+#ifdef LOCK_STATS
+#include <stdio.h>
+
+#define LOCK_STATS_BUCKETS 32	// bucket 0 counts 0 ns, bucket i > 0 counts [2^(i-1), 2^i) ns, the last one everything longer
+
+typedef struct LockSite {
+	const char* file;
+	const char* function;
+	int line;
+	volatile int ready;	// set once the fields above are filled in
+	volatile unsigned long long acquisitions;
+	volatile unsigned long long contended;	// found the lock taken, for try locks the attempts that failed
+	volatile unsigned long long wait_total_ns;
+	volatile unsigned long long hold_total_ns;
+	volatile unsigned long long wait_histogram[LOCK_STATS_BUCKETS];
+	volatile unsigned long long hold_histogram[LOCK_STATS_BUCKETS];
+} LockSite;
+#endif
+
+typedef struct Mutex {
+	volatile int state;	// 0 unlocked, 1 locked, 2 locked and someone may be sleeping on it
+#ifdef LOCK_STATS
+	LockSite* holder;	// only touched by the thread holding the lock
+	unsigned long long acquired_at;
+#endif
+} Mutex;
+
+typedef struct SpinLock {
+	volatile int locked;
+#ifdef LOCK_STATS
+	LockSite* holder;
+	unsigned long long acquired_at;
+#endif
+} SpinLock;
+
+void mutex_init(Mutex* mutex);
+void mutex_lock(Mutex* mutex);
+int mutex_try_lock(Mutex* mutex);
+void mutex_unlock(Mutex* mutex);
+
+void spin_lock_init(SpinLock* lock);
+void spin_lock(SpinLock* lock);
+void spin_unlock(SpinLock* lock);
+
+void lock_set_process_shared(int shared);	// before any lock of a shared arena is taken, for the whole process
+
+// Allocator housekeeping threads
+int thread_create(Thread* thread, void(*work)(void*), void* data);	// 0 on success
+void thread_join(Thread thread);
+void thread_sleep_ms(int ms);
+unsigned monotonic_time_ms();	// wraps around every 49 days, compare differences only
+
+// Arena memory straight from the OS. vm_reserve rounds *bytes up to what it mapped, huge asks for explicit huge
+// pages and falls back to ordinary pages with a transparent huge page hint, *huge says which one it got.
+#define VM_HUGE_PAGE_SIZE ((size_t)2 << 20)
+void* vm_reserve(size_t* bytes, int* huge);	// zeroed, NULL on failure
+void vm_release(void* adr, size_t bytes);
+void vm_discard(void* adr, size_t bytes, int lazy);	// drops the pages, lazy lets the OS take them only under pressure
+size_t vm_page_size();
+
+// Named shared memory objects other processes can open. POSIX only, the Windows versions fail.
+int vm_shared_open(const char* name, size_t bytes, int create);	// handle or -1, create makes a new object of bytes
+void* vm_shared_map(int handle, size_t bytes, void* address);	// exactly at address unless it is NULL, NULL on failure
+void vm_shared_close(int handle);				// the mappings stay valid
+int vm_shared_unlink(const char* name);
+
+#ifdef LOCK_STATS
+void mutex_lock_at(Mutex* mutex, const char* file, int line, const char* function);
+int mutex_try_lock_at(Mutex* mutex, const char* file, int line, const char* function);
+void mutex_unlock_at(Mutex* mutex);
+void spin_lock_at(SpinLock* lock, const char* file, int line, const char* function);
+void spin_unlock_at(SpinLock* lock);
+void lock_stats_print(FILE* out);	// sites sorted by total wait time
+void lock_stats_reset();
+
+#define mutex_lock(mutex) mutex_lock_at((mutex), __FILE__, __LINE__, __func__)
+#define mutex_try_lock(mutex) mutex_try_lock_at((mutex), __FILE__, __LINE__, __func__)
+#define mutex_unlock(mutex) mutex_unlock_at(mutex)
+#define spin_lock(lock) spin_lock_at((lock), __FILE__, __LINE__, __func__)
+#define spin_unlock(lock) spin_unlock_at(lock)
+#else
+#define lock_stats_print(out) ((void)0)
+#define lock_stats_reset() ((void)0)
+#endif
+
+// Relaxed reads, for polling a word before retrying the atomic operation
+static inline int atomic_load_int(volatile int* target) {
+#ifdef _WIN32
+	return *target;
+#else
+	return __atomic_load_n(target, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void atomic_store_int(volatile int* target, int value) {
+#ifdef _WIN32
+	*target = value;
+#else
+	__atomic_store_n(target, value, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void* atomic_load_ptr(void* volatile* target) {
+#ifdef _WIN32
+	return *target;
+#else
+	return __atomic_load_n(target, __ATOMIC_RELAXED);
+#endif
+}
+
+// Acquire read, everything written before the word was published by one of the atomics below is visible after it
+static inline int atomic_load_acquire_int(volatile int* target) {
+#ifdef _WIN32
+	return *target;
+#else
+	return __atomic_load_n(target, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Release write, publishes everything written before it to an acquire read of the word
+static inline void atomic_store_release_int(volatile int* target, int value) {
+#ifdef _WIN32
+	*target = value;
+#else
+	__atomic_store_n(target, value, __ATOMIC_RELEASE);
+#endif
+}
+
+// Relaxed 64 bit accesses, for words written under a lock and peeked at without it
+static inline unsigned long long atomic_load_ull(volatile unsigned long long* target) {
+#ifdef _WIN32
+	return *target;
+#else
+	return __atomic_load_n(target, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void atomic_store_ull(volatile unsigned long long* target, unsigned long long value) {
+#ifdef _WIN32
+	*target = value;
+#else
+	__atomic_store_n(target, value, __ATOMIC_RELAXED);
+#endif
+}
+
+// Statistics counter updated under a lock, so the increment needs no locked instruction
+static inline void locked_add_ull(volatile unsigned long long* target, unsigned long long value) {
+	atomic_store_ull(target, atomic_load_ull(target) + value);
+}
+
+// Statistics counter updated by several threads without a lock, no ordering implied
+static inline void atomic_add_ull(volatile unsigned long long* target, unsigned long long value) {
+#ifdef _WIN32
+	InterlockedExchangeAdd64((volatile LONG64*)target, (LONG64)value);
+#else
+	__atomic_fetch_add(target, value, __ATOMIC_RELAXED);
+#endif
+}
+
+// Atomics below return the previous value, all of them are full barriers
+
+static inline int atomic_exchange_int(volatile int* target, int value) {
+#ifdef _WIN32
+	return (int)InterlockedExchange((volatile LONG*)target, value);
+#else
+	return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline int atomic_compare_exchange_int(volatile int* target, int expected, int desired) {
+#ifdef _WIN32
+	return (int)InterlockedCompareExchange((volatile LONG*)target, desired, expected);
+#else
+	__atomic_compare_exchange_n(target, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return expected;
+#endif
+}
+
+static inline int atomic_fetch_add_int(volatile int* target, int value) {
+#ifdef _WIN32
+	return (int)InterlockedExchangeAdd((volatile LONG*)target, value);
+#else
+	return __atomic_fetch_add(target, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline void* atomic_exchange_ptr(void* volatile* target, void* value) {
+#ifdef _WIN32
+	return InterlockedExchangePointer(target, value);
+#else
+	return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline void* atomic_compare_exchange_ptr(void* volatile* target, void* expected, void* desired) {
+#ifdef _WIN32
+	return InterlockedCompareExchangePointer(target, desired, expected);
+#else
+	__atomic_compare_exchange_n(target, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return expected;
+#endif
+}
+
+static inline void cpu_relax() {
+#if defined(_M_IX86) || defined(_M_X64)
+	_mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static inline void thread_yield() {
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+static inline int processor_count() {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+#endif
+}
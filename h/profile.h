@@ -0,0 +1,42 @@
+#pragma once
+
+#include "lock.h"
+#include <stdlib.h>
+
+// Sampling heap profiler behind the public allocation entry points. Every thread counts down the bytes it allocates,
+// the allocation that takes the count below zero is sampled with its stack and the count restarts from an
+// exponentially distributed interval, so on average one sample is taken per sample_bytes allocated, like tcmalloc.
+// Live samples stay in a side table keyed by object until the object is freed.
+// Stopped, a thread only looks at the global switch once every PROFILE_RECHECK_BYTES it allocates.
+
+#define PROFILE_DEFAULT_SAMPLE_BYTES ((size_t)512 << 10)
+#define PROFILE_RECHECK_BYTES ((long long)1 << 20)
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_SAMPLE_BUCKETS 4096	// live samples by object
+#define PROFILE_STACK_BUCKETS 1024	// call sites by stack
+
+extern THREAD_LOCAL long long profile_bytes_until_sample;
+extern volatile int profile_live_samples;
+
+void profile_sample(void* object, size_t size);
+void profile_forget(const void* object);
+
+static inline void profile_alloc(void* object, size_t size) {
+	if ((profile_bytes_until_sample -= (long long)size) < 0) {
+		profile_sample(object, size);
+	}
+}
+
+static inline void profile_free(const void* object) {
+	if (atomic_load_int(&profile_live_samples)) {
+		profile_forget(object);
+	}
+}
+
+static inline void profile_free_bulk(void** objects, int count) {
+	if (atomic_load_int(&profile_live_samples)) {
+		for (int i = 0; i < count; i++) {
+			profile_forget(objects[i]);
+		}
+	}
+}
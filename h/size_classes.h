@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+
+// kmalloc size classes, four per doubling from 32 bytes up to KMALLOC_MAX_CACHE_SIZE:
+// 32 | 40 48 56 64 | 80 96 112 128 | ... | 5120 6144 7168 8192
+// Everything below is a constant expression, so both tables are built by the compiler.
+
+#define SIZE_CLASS_MIN_SIZE 32
+#define SIZE_CLASS_MIN_DEGREE 5
+#define SIZE_CLASS_MAX_DEGREE 13
+#define SIZE_CLASSES_PER_DOUBLING 4
+#define NUMBER_OF_SIZE_CLASSES (1 + SIZE_CLASSES_PER_DOUBLING * (SIZE_CLASS_MAX_DEGREE - SIZE_CLASS_MIN_DEGREE))
+#define KMALLOC_MAX_CACHE_SIZE (1 << SIZE_CLASS_MAX_DEGREE)	// larger kmalloc requests are served straight from the buddy allocator
+
+// Every class boundary is a multiple of the granule, so one lookup entry per granule is enough
+#define SIZE_CLASS_GRANULE_SHIFT 3
+#define SIZE_CLASS_LOOKUP_LENGTH ((KMALLOC_MAX_CACHE_SIZE >> SIZE_CLASS_GRANULE_SHIFT) + 1)
+
+// The classes in (2^(k-1), 2^k] are 2^(k-1) + 2^(k-3) * {1, 2, 3, 4}
+#define SIZE_CLASS_GROUP(k) \
+	(1 << ((k) - 1)) + 1 * (1 << ((k) - 3)), \
+	(1 << ((k) - 1)) + 2 * (1 << ((k) - 3)), \
+	(1 << ((k) - 1)) + 3 * (1 << ((k) - 3)), \
+	(1 << (k))
+
+// Group of size s > 32, that is the g for which 2^(g+5) < s <= 2^(g+6)
+#define SIZE_CLASS_GROUP_OF(s) \
+	((s) <= 64 ? 0 : (s) <= 128 ? 1 : (s) <= 256 ? 2 : (s) <= 512 ? 3 : \
+	 (s) <= 1024 ? 4 : (s) <= 2048 ? 5 : (s) <= 4096 ? 6 : 7)
+
+#define SIZE_CLASS_OF(s) \
+	((s) <= SIZE_CLASS_MIN_SIZE ? 0 : \
+	 1 + SIZE_CLASSES_PER_DOUBLING * SIZE_CLASS_GROUP_OF(s) + \
+	 (((s) - 1 - (SIZE_CLASS_MIN_SIZE << SIZE_CLASS_GROUP_OF(s))) >> (SIZE_CLASS_GROUP_OF(s) + 3)))
+
+static const int size_class_sizes[NUMBER_OF_SIZE_CLASSES] = {
+	SIZE_CLASS_MIN_SIZE,
+	SIZE_CLASS_GROUP(6), SIZE_CLASS_GROUP(7), SIZE_CLASS_GROUP(8), SIZE_CLASS_GROUP(9),
+	SIZE_CLASS_GROUP(10), SIZE_CLASS_GROUP(11), SIZE_CLASS_GROUP(12), SIZE_CLASS_GROUP(13)
+};
+
+#define SIZE_CLASS_LOOKUP_1(i) SIZE_CLASS_OF((i) << SIZE_CLASS_GRANULE_SHIFT),
+#define SIZE_CLASS_LOOKUP_4(i) SIZE_CLASS_LOOKUP_1(i) SIZE_CLASS_LOOKUP_1((i) + 1) SIZE_CLASS_LOOKUP_1((i) + 2) SIZE_CLASS_LOOKUP_1((i) + 3)
+#define SIZE_CLASS_LOOKUP_16(i) SIZE_CLASS_LOOKUP_4(i) SIZE_CLASS_LOOKUP_4((i) + 4) SIZE_CLASS_LOOKUP_4((i) + 8) SIZE_CLASS_LOOKUP_4((i) + 12)
+#define SIZE_CLASS_LOOKUP_64(i) SIZE_CLASS_LOOKUP_16(i) SIZE_CLASS_LOOKUP_16((i) + 16) SIZE_CLASS_LOOKUP_16((i) + 32) SIZE_CLASS_LOOKUP_16((i) + 48)
+#define SIZE_CLASS_LOOKUP_256(i) SIZE_CLASS_LOOKUP_64(i) SIZE_CLASS_LOOKUP_64((i) + 64) SIZE_CLASS_LOOKUP_64((i) + 128) SIZE_CLASS_LOOKUP_64((i) + 192)
+#define SIZE_CLASS_LOOKUP_1024(i) SIZE_CLASS_LOOKUP_256(i) SIZE_CLASS_LOOKUP_256((i) + 256) SIZE_CLASS_LOOKUP_256((i) + 512) SIZE_CLASS_LOOKUP_256((i) + 768)
+
+// Entry i is the class of a request of (i << SIZE_CLASS_GRANULE_SHIFT) bytes, and of every smaller one down to the previous entry
+static const unsigned char size_class_lookup[SIZE_CLASS_LOOKUP_LENGTH] = {
+	SIZE_CLASS_LOOKUP_1024(0)
+	SIZE_CLASS_LOOKUP_1(1024)
+};
+
+static inline int size_class_of(size_t size) {
+	return size_class_lookup[(size + (1 << SIZE_CLASS_GRANULE_SHIFT) - 1) >> SIZE_CLASS_GRANULE_SHIFT];
+}
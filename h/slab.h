@@ -2,18 +2,86 @@
 
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct kmem_cache_s kmem_cache_t;
 
 #define BLOCK_SIZE (4096)
 #define CACHE_L1_LINE_SIZE (64)
 
-void kmem_init(void* space, int block_num);
-kmem_cache_t * kmem_cache_create(const char* name, size_t size, void (*ctor)(void*), void (*dtor)(void*)); // Allocate cache
+#define KMEM_CACHE_NO_MERGE (1u << 0)	// never share slabs with other caches
+
+#define KMEM_ARENA_HUGE_PAGES (1u << 0)		// back the arena with huge pages, or hint transparent huge pages when there are none
+#define KMEM_ARENA_LAZY_RELEASE (1u << 1)	// MADV_FREE instead of MADV_DONTNEED, the OS takes released pages only under pressure
+
+// Counters are read one by one without stopping allocations, so related counters may be a few operations apart
+typedef struct kmem_cache_stats {
+	char name[32];
+	char merged_into[32];		// shared cache of an alias, empty otherwise
+	size_t object_size;
+	int objects_per_slab;
+	int slab_size_in_blocks;
+	unsigned long long allocs;
+	unsigned long long frees;
+	unsigned long long failures;
+	unsigned long long active_objects;
+	unsigned long long slab_grows;		// slab counters of an alias are 0, its slabs are counted by the shared cache
+	unsigned long long slab_shrinks;
+	unsigned long long active_slabs;
+} kmem_cache_stats_t;
+
+// Shrinkers run when an allocation finds the buddy allocator exhausted even after empty slabs and magazines were
+// reclaimed. They free whatever objects their client can spare and return how many they freed, they may allocate
+// and free but never register or unregister shrinkers.
+typedef size_t (*kmem_shrinker_t)(size_t blocks_wanted, void* data);
+
+void kmem_init(void* space, size_t block_num);
+int kmem_init_arena(size_t block_num, unsigned flags, int release_order); // Map the arena from the OS and kmem_init it, free runs of 2^release_order blocks or more are handed back to the OS (-1 never), 0 on success or -1
+void kmem_release_arena(); // Unmap the arena of kmem_init_arena or kmem_shared_*, once the reaper is stopped and nothing uses it. The allocator is uninitialized afterwards, kmem_init* may set it up again.
+#ifdef KMEM_SHARED_ARENA
+// Fixed-address mode, built with KMEM_SHARED_ARENA (the memory_allocator_shared library). A shared arena is mapped at
+// the same address in every process, the allocator keeps plain pointers in it, so its caches and objects can be passed
+// around as they are. The address is picked by the name, high in the address space where 64-bit processes normally map
+// nothing. Creating or attaching fails when anything in the process, its binary, heap, stacks or another mapping,
+// already takes part of that range, so attach early, before the process maps much.
+// Its caches take no ctor or dtor and it runs no shrinkers, only the process that started the reaper stops it.
+// A process that dies holding an allocator lock leaves it locked for the others.
+int kmem_shared_create(const char* name, size_t block_num); // Create a named shared memory arena other processes can attach, 0 on success or -1
+int kmem_shared_attach(const char* name); // Attach the shared arena another process created, 0 on success or -1
+int kmem_shared_unlink(const char* name); // Remove the name, the memory goes away once every process released the arena
+#endif
+kmem_cache_t* kmem_cache_find(const char* name); // First cache created with this name, NULL if there is none
+kmem_cache_t * kmem_cache_create(const char* name, size_t size, void (*ctor)(void*), void (*dtor)(void*)); // Allocate cache, ctor runs once per object when its slab is created, dtor when the slab is released
+kmem_cache_t * kmem_cache_create_flags(const char* name, size_t size, void (*ctor)(void*), void (*dtor)(void*), unsigned flags); // Same, caches without ctor and dtor are aliases of a shared cache of their size unless KMEM_CACHE_NO_MERGE is set
+kmem_cache_t * kmem_cache_create_aligned(const char* name, size_t size, size_t align, void (*ctor)(void*), void (*dtor)(void*), unsigned flags); // Same, objects start at multiples of align, a power of two up to BLOCK_SIZE (0 for natural alignment)
 int kmem_cache_shrink(kmem_cache_t * cachep); // Shrink cache
 void* kmem_cache_alloc(kmem_cache_t * cachep); // Allocate one object from cache
 void kmem_cache_free(kmem_cache_t * cachep, void* objp); // Deallocate one object from cache
-void* kmalloc(size_t size); // Alloacate one small memory buffer
-void kfree(const void* objp); // Deallocate one small memory buffer
+int kmem_cache_alloc_bulk(kmem_cache_t * cachep, void** objects, int count); // Allocate up to count objects, returns how many were allocated
+void kmem_cache_free_bulk(kmem_cache_t * cachep, void** objects, int count); // Deallocate count objects from cache
+void* kmalloc(size_t size); // Alloacate one memory buffer, large ones come straight from the buddy allocator. Aligned to the largest power of two dividing its size class up to twice the pointer size, large ones to a block
+void kfree(const void* objp); // Deallocate one memory buffer
 void kmem_cache_destroy(kmem_cache_t * cachep); // Deallocate cache
 void kmem_cache_info(kmem_cache_t * cachep); // Print cache info
-int kmem_cache_error(kmem_cache_t * cachep); // Print error message
\ No newline at end of file
+int kmem_cache_error(kmem_cache_t * cachep); // Print error message
+int kmem_cache_set_magazine_size(kmem_cache_t * cachep, int size); // Tune per-thread magazine depth (0 disables), right after creating the cache and before it is used
+void kmem_cache_get_stats(kmem_cache_t * cachep, kmem_cache_stats_t * stats); // Read the counters of one cache without stopping it
+int kmem_stats_snapshot(kmem_cache_stats_t * stats, int max_caches); // Fill up to max_caches entries, returns the number of caches
+int kmem_stats_json(char* buffer, size_t size); // Every cache and buddy order as JSON, returns the length like snprintf
+size_t kmem_reap(); // Flush depot magazines and release empty slabs idle past the reap policy of every cache once, returns the number of blocks given back
+int kmem_reaper_start(int interval_ms); // Run kmem_reap every interval_ms on a background thread, -1 if it is already running
+unsigned long long kmem_reaper_stop(); // Stop the reaper before the arena goes away, returns the blocks reclaimed so far
+unsigned long long kmem_reaped_blocks(); // Blocks reclaimed by kmem_reap and the reaper so far
+void kmem_cache_set_reap_policy(kmem_cache_t * cachep, int warm_slabs, int idle_ms); // Keep warm_slabs empty slabs, reap the rest once idle for idle_ms (defaults 1 and 1000)
+int kmem_register_shrinker(kmem_shrinker_t shrink, void* data); // Called when memory runs out, 0 on success or -1 if MAX_SHRINKERS are registered or the arena is shared
+void kmem_unregister_shrinker(kmem_shrinker_t shrink, void* data); // Not from inside a shrinker
+// Sampling heap profiler over kmem_cache_alloc and kmalloc, profiles belong to the process even in a shared arena
+void kmem_profile_start(size_t sample_bytes); // Sample one allocation per sample_bytes allocated on average (0 for 512 KiB), drops earlier samples
+void kmem_profile_stop(); // Stop sampling, the samples are kept and still follow frees
+int kmem_profile_dump(const char* path); // Write the live and allocated samples as a pprof heap profile, 0 on success or -1
+
+#ifdef __cplusplus
+}
+#endif
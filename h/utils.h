@@ -1,12 +1,18 @@
 #pragma once
 
-const char small_buffer_cache_name[] = "small_buffer_cache";
-const char cache_of_caches_name[] = "cache_of_caches";
-#define NUMBER_OF_BUFFER_DEGREES 13
-#define STARTING_BUFFER_DEGREE 5
-const int bits_in_unsigned = sizeof(unsigned) * 8;
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
-unsigned int next_power_of_two(unsigned int n) {
+static const char small_buffer_cache_name[] = "small_buffer_cache";
+static const char cache_of_caches_name[] = "cache_of_caches";
+static const char magazine_cache_name[] = "magazine_cache";
+static const char slab_management_cache_name[] = "slab_management_cache";
+static const char alias_cache_name[] = "alias_cache";
+static const char merged_cache_name[] = "merged_cache";
+static const int bits_in_unsigned = sizeof(unsigned) * 8;
+
+static inline unsigned int next_power_of_two(unsigned int n) {
     unsigned int p = 1;
     if (n && !(n & (n - 1))) {
         return n;
@@ -17,18 +23,51 @@ unsigned int next_power_of_two(unsigned int n) {
     return p;
 }
 
-int previous_power_of_two(unsigned int n) {
+static inline int previous_power_of_two(unsigned int n) {
     if (n < 1) {
         return 0;
     }
     int res = 1;
-    for (int i = 0; i < 8 * sizeof(unsigned int); i++)
+    for (unsigned int i = 0; i < 8 * sizeof(unsigned int); i++)
     {
-        int curr = 1 << i;
+        unsigned int curr = 1u << i;
         if (curr > n) {
             break;
         }
         res = curr;
     }
     return res;
+}
+
+// Index of the highest set bit, n must not be 0
+static inline int floor_log2(unsigned long long n) {
+#ifdef _MSC_VER
+    unsigned long index;
+    if (_BitScanReverse(&index, (unsigned long)(n >> 32))) {
+        return (int)index + 32;
+    }
+    _BitScanReverse(&index, (unsigned long)n);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(n);
+#endif
+}
+
+// Smallest k such that 2^k >= n
+static inline int ceil_log2(unsigned long long n) {
+    return n <= 1 ? 0 : floor_log2(n - 1) + 1;
+}
+
+// Index of the lowest set bit, n must not be 0
+static inline int count_trailing_zeros(unsigned long long n) {
+#ifdef _MSC_VER
+    unsigned long index;
+    if (_BitScanForward(&index, (unsigned long)n)) {
+        return (int)index;
+    }
+    _BitScanForward(&index, (unsigned long)(n >> 32));
+    return (int)index + 32;
+#else
+    return __builtin_ctzll(n);
+#endif
 }
\ No newline at end of file
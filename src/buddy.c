@@ -1,8 +1,8 @@
-#pragma once
-
 #include "buddy.h"
+#include "utils.h"
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 static BuddyManager* buddy_manager = NULL;
 
@@ -12,10 +12,19 @@ BuddyManager* get_buddy_manager() {
 }
 
 
+void attach_buddy_manager(void* space) {
+	buddy_manager = (BuddyManager*)space;
+}
+
+
+static THREAD_LOCAL int home_shard = -1;
+static volatile int home_shard_counter = 0;
+
+
 void print_buddy_list(Block* head) {
 	Block* iter = head;
 	while (iter) {
-		printf("%x -> ", iter);
+		printf("%p -> ", (void*)iter);
 		iter = iter->next;
 	}
 	printf("\n");
@@ -25,166 +34,609 @@ void print_buddy_list(Block* head) {
 void print_buddy_manager() {
 	printf("\n\n\n");
 	printf("~~~BUDDY MANAGER~~~\n\n");
-	printf("Number of blocks: %d\n", buddy_manager->number_of_blocks);
+	printf("Number of blocks: %zu\n", buddy_manager->number_of_blocks);
 	printf("Largest block degree: %d\n", buddy_manager->largest_block_degree2);
-	printf("Starting block address: %x\n", (unsigned)buddy_manager->starting_block_adr);
-	printf("Headers:\n\n");
-	for (int index = 0; index <= buddy_manager->largest_block_degree2; index++) {
-		printf("[%03d]: ", (int)pow(2, index));
-		print_buddy_list(buddy_manager->headers[index]);
+	printf("Starting block address: %p\n", (void*)buddy_manager->starting_block_adr);
+	printf("Number of shards: %d\n", buddy_manager->number_of_shards);
+	for (int i = 0; i < buddy_manager->number_of_shards; i++) {
+		BuddyShard* shard = &buddy_manager->shards[i];
+		mutex_lock(&shard->mutex);
+		printf("\nShard %d: blocks %zu - %zu\n", i, shard->first_block, shard->first_block + shard->number_of_blocks - 1);
+		printf("Headers:\n\n");
+		for (int index = 0; index <= shard->largest_block_degree2; index++) {
+			printf("[%03zu]: ", (size_t)1 << index);
+			print_buddy_list(shard->headers[index]);
+		}
+		mutex_unlock(&shard->mutex);
 	}
+	for (int i = 0; i < buddy_manager->number_of_page_caches; i++) {
+		PageCache* cache = &buddy_manager->page_caches[i];
+		printf("\nPage cache %d: ", i);
+		for (int index = 0; index <= PAGE_CACHE_MAX_ORDER; index++) {
+			printf("[%03zu]: %d ", (size_t)1 << index, atomic_load_int(&cache->count[index]));
+		}
+	}
+	printf("\n");
 }
 
 
-int find_minimum_sized_buddy(int minimum_index) {
-	for (int index = minimum_index; index <= buddy_manager->largest_block_degree2; index++) {
-		if (buddy_manager->headers[index]) {
-			return index;
+// Lock free, an allocation running concurrently may be seen half done
+void get_buddy_stats(BuddyStats* stats) {
+	memset(stats, 0, sizeof(*stats));
+	stats->number_of_blocks = buddy_manager->number_of_blocks;
+	stats->largest_block_degree2 = buddy_manager->largest_block_degree2;
+	stats->number_of_shards = buddy_manager->number_of_shards;
+
+	for (int i = 0; i < buddy_manager->number_of_shards; i++) {
+		BuddyShard* shard = &buddy_manager->shards[i];
+		for (int index = 0; index <= shard->largest_block_degree2; index++) {
+			unsigned long long free_runs = atomic_load_ull(&shard->free_runs[index]);
+			stats->orders[index].free_blocks += free_runs;
+			stats->orders[index].splits += atomic_load_ull(&shard->splits[index]);
+			stats->orders[index].merges += atomic_load_ull(&shard->merges[index]);
+			stats->free_blocks += (size_t)(free_runs << index);
 		}
 	}
-	return -1;
+	for (int i = 0; i < buddy_manager->number_of_page_caches; i++) {
+		PageCache* cache = &buddy_manager->page_caches[i];
+		for (int index = 0; index <= PAGE_CACHE_MAX_ORDER; index++) {
+			stats->cached_blocks += (size_t)atomic_load_int(&cache->count[index]) << index;
+		}
+	}
+	stats->released_blocks = atomic_load_ull(&buddy_manager->released_blocks);
 }
 
 
-Block* get_buddy(int size) {
+int find_minimum_sized_buddy(BuddyShard* shard, int minimum_index) {
+	if (minimum_index > shard->largest_block_degree2) {
+		return -1;
+	}
+	unsigned long long candidates = shard->nonempty_orders >> minimum_index;
+	if (!candidates) {
+		return -1;
+	}
+	return minimum_index + count_trailing_zeros(candidates);
+}
 
-	WaitForSingleObject(buddy_manager->dhMutex, INFINITE);
 
-	if (size == 0) {
-		printf("\nSize cannot be 0!\n");
-		ReleaseMutex(buddy_manager->dhMutex);
-		return NULL;
+void buddy_list_add(BuddyShard* shard, Block* block, int index) {
+	block->prev = NULL;
+	block->next = shard->headers[index];
+	if (block->next) {
+		block->next->prev = block;
 	}
+	shard->headers[index] = block;
+	atomic_store_ull(&shard->nonempty_orders, shard->nonempty_orders | 1ULL << index);
+	locked_add_ull(&shard->free_runs[index], 1);
+	buddy_manager->block_state[block - buddy_manager->starting_block_adr] = BLOCK_FREE | index;
+}
 
-	int minimum_index = (int)log2(next_power_of_two(size));
-	int block_to_take_index = find_minimum_sized_buddy(minimum_index);
 
+void buddy_list_remove(BuddyShard* shard, Block* block, int index) {
+	if (block->prev) {
+		block->prev->next = block->next;
+	}
+	else {
+		shard->headers[index] = block->next;
+	}
+	if (block->next) {
+		block->next->prev = block->prev;
+	}
+	block->next = block->prev = NULL;
+	locked_add_ull(&shard->free_runs[index], (unsigned long long)-1);
+	if (!shard->headers[index]) {
+		atomic_store_ull(&shard->nonempty_orders, shard->nonempty_orders & ~(1ULL << index));
+	}
+	buddy_manager->block_state[block - buddy_manager->starting_block_adr] = 0;
+}
+
+
+BuddyShard* get_shard_of(Block* block) {
+	size_t shard_index = (size_t)(block - buddy_manager->starting_block_adr) / buddy_manager->shard_size;
+	if (shard_index >= (size_t)buddy_manager->number_of_shards) {
+		shard_index = buddy_manager->number_of_shards - 1;
+	}
+	return &buddy_manager->shards[shard_index];
+}
+
+
+// Threads are spread over the shards and page caches round robin the first time they allocate
+int get_home_slot() {
+	if (home_shard == -1) {
+		home_shard = atomic_fetch_add_int(&home_shard_counter, 1) % BUDDY_MAX_SHARDS;
+	}
+	return home_shard;
+}
+
+int get_home_shard() {
+	return get_home_slot() % buddy_manager->number_of_shards;
+}
+
+
+Block* take_buddy_locked(BuddyShard* shard, int minimum_index) {
+
+	int block_to_take_index = find_minimum_sized_buddy(shard, minimum_index);
 	if (block_to_take_index == -1) {
-		//printf("Not enough memory to allocate buddy with size %d\n", size);
-		ReleaseMutex(buddy_manager->dhMutex);
 		return NULL;		//not enough memory
 	}
 
-	Block* to_take = buddy_manager->headers[block_to_take_index];
-	buddy_manager->headers[block_to_take_index] = buddy_manager->headers[block_to_take_index]->next;
-	to_take->next = NULL;
+	Block* to_take = shard->headers[block_to_take_index];
+	buddy_list_remove(shard, to_take, block_to_take_index);
 
 	int index = block_to_take_index;
 
 	while (index > minimum_index) {
+		locked_add_ull(&shard->splits[index], 1);
 		index--;
-		int offset = 1 << index;
-
-		Block* right_half = to_take + offset;
+		Block* right_half = to_take + ((size_t)1 << index);
 
-		to_take->next = buddy_manager->headers[index];
-		buddy_manager->headers[index] = to_take;
+		buddy_list_add(shard, to_take, index);
 		to_take = right_half;
 	}
 
-	ReleaseMutex(buddy_manager->dhMutex);
 	return to_take;
 }
 
 
-Block* get_potential_buddy_of(Block* block, int size_of_block) {
+Block* get_buddy_from_shard(BuddyShard* shard, int minimum_index) {
+
+	// Lock free peek, the shard is only locked when it looks like it can serve the request
+	if (!(atomic_load_ull(&shard->nonempty_orders) >> minimum_index)) {
+		return NULL;
+	}
+
+	mutex_lock(&shard->mutex);
+	Block* block = take_buddy_locked(shard, minimum_index);
+	mutex_unlock(&shard->mutex);
+	return block;
+}
+
+
+Block* get_buddy_from_shards(int minimum_index) {
+
+	int home = get_home_shard();
+	for (int i = 0; i < buddy_manager->number_of_shards; i++) {
+		int shard_index = (home + i) % buddy_manager->number_of_shards;
+		Block* block = get_buddy_from_shard(&buddy_manager->shards[shard_index], minimum_index);
+		if (block) {
+			return block;
+		}
+	}
+	return NULL;
+}
+
+
+// Takes up to count runs of order index, home shard first, with one lock round trip per shard.
+// The runs come back linked through next, prev is not set.
+Block* get_buddy_batch(int index, int count, int* taken) {
+
+	Block* chain = NULL;
+	*taken = 0;
+	int home = get_home_shard();
+	for (int i = 0; i < buddy_manager->number_of_shards && *taken < count; i++) {
+		BuddyShard* shard = &buddy_manager->shards[(home + i) % buddy_manager->number_of_shards];
+		if (!(atomic_load_ull(&shard->nonempty_orders) >> index)) {
+			continue;
+		}
+		mutex_lock(&shard->mutex);
+		while (*taken < count) {
+			Block* block = take_buddy_locked(shard, index);
+			if (!block) {
+				break;
+			}
+			block->next = chain;
+			chain = block;
+			(*taken)++;
+		}
+		mutex_unlock(&shard->mutex);
+	}
+	return chain;
+}
 
-	int index = (int)log2(next_power_of_two(size_of_block));
-	int block_offset = (unsigned)block - (unsigned)buddy_manager->starting_block_adr;
 
-	unsigned parity_bit_mask = (1 << (block_offset_bit_cnt + index));
-	int odd = parity_bit_mask & block_offset;
+PageCache* get_page_cache() {
+	return &buddy_manager->page_caches[get_home_slot() % buddy_manager->number_of_page_caches];
+}
 
-	unsigned buddy = buddy_manager->starting_block_adr;
 
-	if (odd) {
-		buddy += (block_offset - parity_bit_mask);
+// Pushes runs at the hot end
+void page_cache_push(PageCache* cache, Block* block, int index) {
+	block->prev = NULL;
+	block->next = cache->head[index];
+	if (block->next) {
+		block->next->prev = block;
 	}
 	else {
-		buddy += (block_offset + parity_bit_mask);
+		cache->tail[index] = block;
 	}
+	cache->head[index] = block;
+	atomic_store_int(&cache->count[index], cache->count[index] + 1);
+}
+
 
-	return (Block*)buddy;
+// Detaches up to count runs from the cold end, linked through next
+Block* page_cache_detach_cold(PageCache* cache, int index, int count) {
+	Block* chain = NULL;
+	while (count-- > 0 && cache->tail[index]) {
+		Block* block = cache->tail[index];
+		cache->tail[index] = block->prev;
+		if (block->prev) {
+			block->prev->next = NULL;
+		}
+		else {
+			cache->head[index] = NULL;
+		}
+		block->next = chain;
+		chain = block;
+		atomic_store_int(&cache->count[index], cache->count[index] - 1);
+	}
+	return chain;
 }
 
 
-void put_buddy(Block* block, int size_of_block) {
+// A miss refills page_cache_batch runs in one go, the shard locks are never taken under the page cache lock
+Block* page_cache_get(int index) {
 
-	WaitForSingleObject(buddy_manager->dhMutex, INFINITE);
+	PageCache* cache = get_page_cache();
+	spin_lock(&cache->lock);
+	Block* block = cache->head[index];
+	if (block) {
+		cache->head[index] = block->next;
+		if (block->next) {
+			block->next->prev = NULL;
+		}
+		else {
+			cache->tail[index] = NULL;
+		}
+		atomic_store_int(&cache->count[index], cache->count[index] - 1);
+		spin_unlock(&cache->lock);
+		block->next = block->prev = NULL;
+		return block;
+	}
+	spin_unlock(&cache->lock);
 
-	int index = (int)log2(next_power_of_two(size_of_block));
-	Block* buddy = get_potential_buddy_of(block, size_of_block);
+	int taken;
+	Block* chain = get_buddy_batch(index, buddy_manager->page_cache_batch, &taken);
+	if (!chain) {
+		return NULL;
+	}
+	block = chain;
+	chain = chain->next;
+	block->next = NULL;
+
+	if (chain) {
+		spin_lock(&cache->lock);
+		while (chain) {
+			Block* next = chain->next;
+			page_cache_push(cache, chain, index);
+			chain = next;
+		}
+		spin_unlock(&cache->lock);
+	}
+	return block;
+}
 
-	Block* iterator, * prev;
-	iterator = buddy_manager->headers[index];
-	prev = NULL;
 
-	if (!iterator) {
-		block->next = NULL;
-		buddy_manager->headers[index] = block;
-		ReleaseMutex(buddy_manager->dhMutex);
-		return;
+// Takes the run from the home shard, a shard that cannot serve the request steals it from the others.
+// A stolen run still belongs to the shard it came from and goes back there in put_buddy.
+Block* get_buddy(size_t size) {
+
+	if (size == 0) {
+		printf("\nSize cannot be 0!\n");
+		return NULL;
 	}
 
-	while (iterator) {
-		if (iterator == buddy) {
+	int minimum_index = ceil_log2(size);
+	if (minimum_index > buddy_manager->largest_block_degree2) {
+		return NULL;
+	}
 
-			if (!prev) {
-				buddy_manager->headers[index] = iterator->next;
-			}
-			else {
-				prev->next = iterator->next;
+	Block* block;
+	if (minimum_index <= PAGE_CACHE_MAX_ORDER && buddy_manager->page_cache_high) {
+		block = page_cache_get(minimum_index);
+	}
+	else {
+		block = get_buddy_from_shards(minimum_index);
+	}
+	if (block) {
+		return block;
+	}
+
+	// The runs parked in the page caches may be all that is left, or may be what a larger run is missing
+	buddy_drain_page_caches();
+	block = get_buddy_from_shards(minimum_index);
+
+	//printf("Not enough memory to allocate buddy with size %d\n", size);
+	return block;
+}
+
+
+// Lock free peek, a concurrent allocation may take the run before the caller gets to it
+int buddy_has_free_run(size_t size) {
+	int minimum_index = ceil_log2(size ? size : 1);
+	if (minimum_index > buddy_manager->largest_block_degree2) {
+		return 0;
+	}
+	for (int i = 0; i < buddy_manager->number_of_shards; i++) {
+		if (atomic_load_ull(&buddy_manager->shards[i].nonempty_orders) >> minimum_index) {
+			return 1;
+		}
+	}
+	for (int i = 0; i < buddy_manager->number_of_page_caches; i++) {
+		for (int index = minimum_index; index <= PAGE_CACHE_MAX_ORDER; index++) {
+			if (atomic_load_int(&buddy_manager->page_caches[i].count[index])) {
+				return 1;
 			}
+		}
+	}
+	return 0;
+}
+
+
+Block* get_potential_buddy_of(BuddyShard* shard, Block* block, size_t size_of_block) {
+
+	Block* shard_start = buddy_manager->starting_block_adr + shard->first_block;
+	size_t block_offset = (size_t)(block - shard_start);
+	return shard_start + (block_offset ^ size_of_block);
+}
+
+
+void buddy_set_release(int order, size_t granule, int lazy) {
+	buddy_manager->release_order = order;
+	buddy_manager->release_granule = granule < BLOCK_SIZE ? BLOCK_SIZE : granule;
+	buddy_manager->release_lazy = lazy;
+}
+
+
+// Hands the blocks [first, first + size) back to the OS, except skip, the first block of the free run that holds
+// its list links. Runs under the shard lock, the blocks could be allocated and written the moment it is dropped.
+void release_blocks(Block* first, size_t size, Block* skip) {
+
+	if (skip >= first && skip < first + size) {
+		release_blocks(first, (size_t)(skip - first), NULL);
+		release_blocks(skip + 1, size - (size_t)(skip + 1 - first), NULL);
+		return;
+	}
+
+	size_t granule = buddy_manager->release_granule;
+	size_t start = ((size_t)first + granule - 1) & ~(granule - 1);
+	size_t end = (size_t)(first + size) & ~(granule - 1);
+	if (start >= end) {
+		return;
+	}
+	vm_discard((void*)start, end - start, buddy_manager->release_lazy);
+	atomic_add_ull(&buddy_manager->released_blocks, (end - start) / BLOCK_SIZE);
+}
+
+
+void put_buddy_locked(BuddyShard* shard, Block* block, int index) {
+
+	Block* freed = block;
+	int freed_index = index;
+	int release_order = buddy_manager->release_order;
+	Block* released_headers[64];		// first blocks of the already released buddies merged on the way up
+	int released_header_cnt = 0;
+
+	while (index < shard->largest_block_degree2) {
+		size_t run = (size_t)1 << index;
+		Block* buddy = get_potential_buddy_of(shard, block, run);
+		size_t buddy_offset = (size_t)(buddy - buddy_manager->starting_block_adr);
+
+		if (buddy_offset - shard->first_block + run > shard->number_of_blocks) {
+			break;
+		}
+		if (buddy_manager->block_state[buddy_offset] != (BLOCK_FREE | index)) {
+			break;
+		}
+
+		buddy_list_remove(shard, buddy, index);
+		locked_add_ull(&shard->merges[index], 1);
+		if (release_order >= 0 && index >= release_order) {
+			released_headers[released_header_cnt++] = buddy;
+		}
+		if (buddy < block) {
+			block = buddy;
+		}
+		index++;
+	}
+
+	buddy_list_add(shard, block, index);
+
+	// Only the part that was never released is handed back: the freed run together with the buddies below
+	// release_order it merged with, and the granule holding the list links of every released buddy above it
+	if (release_order >= 0 && index >= release_order) {
+		size_t header_blocks = buddy_manager->release_granule / BLOCK_SIZE;
+		int fresh_index = freed_index > release_order ? freed_index : release_order;
+		Block* shard_start = buddy_manager->starting_block_adr + shard->first_block;
+		size_t fresh_offset = (size_t)(freed - shard_start) & ~(((size_t)1 << fresh_index) - 1);
+		release_blocks(shard_start + fresh_offset, (size_t)1 << fresh_index, block);
+		for (int i = 0; i < released_header_cnt; i++) {
+			release_blocks(released_headers[i], header_blocks, block);
+		}
+	}
+}
 
-			Block* to_insert;
-			if ((unsigned)block < (unsigned)buddy) {
-				to_insert = block;
+
+// Gives a chain of runs of order index linked through next back to their shards,
+// keeping a shard locked while consecutive runs belong to it
+void put_buddy_chain(Block* chain, int index) {
+
+	BuddyShard* locked = NULL;
+	while (chain) {
+		Block* next = chain->next;
+		BuddyShard* shard = get_shard_of(chain);
+		if (shard != locked) {
+			if (locked) {
+				mutex_unlock(&locked->mutex);
 			}
-			else {
-				to_insert = buddy;
+			mutex_lock(&shard->mutex);
+			locked = shard;
+		}
+		put_buddy_locked(shard, chain, index);
+		chain = next;
+	}
+	if (locked) {
+		mutex_unlock(&locked->mutex);
+	}
+}
+
+
+void put_buddy(Block* block, size_t size_of_block) {
+
+	int index = ceil_log2(size_of_block);
+
+	if (index <= PAGE_CACHE_MAX_ORDER && buddy_manager->page_cache_high) {
+		PageCache* cache = get_page_cache();
+		Block* chain = NULL;
+		spin_lock(&cache->lock);
+		page_cache_push(cache, block, index);
+		if (cache->count[index] > buddy_manager->page_cache_high) {
+			chain = page_cache_detach_cold(cache, index, buddy_manager->page_cache_batch);
+		}
+		spin_unlock(&cache->lock);
+		put_buddy_chain(chain, index);
+		return;
+	}
+
+	BuddyShard* shard = get_shard_of(block);
+	mutex_lock(&shard->mutex);
+	put_buddy_locked(shard, block, index);
+	mutex_unlock(&shard->mutex);
+}
+
+
+void buddy_drain_page_caches() {
+
+	for (int i = 0; i < buddy_manager->number_of_page_caches; i++) {
+		PageCache* cache = &buddy_manager->page_caches[i];
+		for (int index = 0; index <= PAGE_CACHE_MAX_ORDER; index++) {
+			if (!atomic_load_int(&cache->count[index])) {
+				continue;
 			}
+			spin_lock(&cache->lock);
+			Block* chain = page_cache_detach_cold(cache, index, cache->count[index]);
+			spin_unlock(&cache->lock);
+			put_buddy_chain(chain, index);
+		}
+	}
+}
+
 
-			put_buddy(to_insert, 2 * size_of_block);
-			ReleaseMutex(buddy_manager->dhMutex);
-			return;
+// Adds shard blocks [offset, offset + size) to the free lists as maximal naturally aligned power of two runs,
+// which is exactly what freeing them one by one would coalesce into. The neighbours of the range must not be free.
+void insert_free_range(BuddyShard* shard, size_t offset, size_t size) {
+	while (size > 0) {
+		int index = offset ? count_trailing_zeros(offset) : shard->largest_block_degree2;
+		while (((size_t)1 << index) > size) {
+			index--;
 		}
-		prev = iterator;
-		iterator = iterator->next;
+
+		buddy_list_add(shard, buddy_manager->starting_block_adr + shard->first_block + offset, index);
+		offset += (size_t)1 << index;
+		size -= (size_t)1 << index;
 	}
+}
+
 
-	block->next = buddy_manager->headers[index];
-	buddy_manager->headers[index] = block;
+void init_buddy_shard(BuddyShard* shard, size_t first_block, size_t block_num) {
 
-	ReleaseMutex(buddy_manager->dhMutex);
+	mutex_init(&shard->mutex);
+	shard->first_block = first_block;
+	shard->number_of_blocks = block_num;
+	shard->largest_block_degree2 = floor_log2(block_num);
+	for (int i = 0; i <= shard->largest_block_degree2; i++) {
+		shard->headers[i] = NULL;
+	}
+	shard->nonempty_orders = 0;
+	memset((void*)shard->free_runs, 0, sizeof(shard->free_runs));
+	memset((void*)shard->splits, 0, sizeof(shard->splits));
+	memset((void*)shard->merges, 0, sizeof(shard->merges));
+
+	insert_free_range(shard, 0, block_num);
 }
 
 
-void init_buddy_manager(void* space, int block_num) {
+// The manager area holds the BuddyManager, client_size bytes for the client (at buddy_manager + 1) and the block state map
+void init_buddy_manager(void* space, size_t block_num, size_t client_size, int shard_num, size_t alignment) {
+
+	size_t manager_size = sizeof(BuddyManager) + client_size + block_num;
+	size_t manager_blocks = (manager_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-	if (block_num < 2) {
+	// The blocks between the manager and the next alignment boundary are never used, nor touched
+	if (alignment < BLOCK_SIZE) {
+		alignment = BLOCK_SIZE;
+	}
+	size_t alignment_blocks = alignment / BLOCK_SIZE;
+	size_t blocks_start = ((size_t)((Block*)space + manager_blocks) + alignment - 1) & ~(alignment - 1);
+	manager_blocks = (blocks_start - (size_t)space) / BLOCK_SIZE;
+
+	if (block_num < manager_blocks + 1) {
 		printf("\nNot enough memory!\n");
 		exit(-1);
 	}
 
 	Block* first_block = (Block*)space;
 	buddy_manager = (BuddyManager*)space;
-	first_block++;
-	block_num--;
+	first_block += manager_blocks;
+	block_num -= manager_blocks;
+
+	if (shard_num <= 0) {
+		shard_num = processor_count();
+	}
+	if (shard_num > BUDDY_MAX_SHARDS) {
+		shard_num = BUDDY_MAX_SHARDS;
+	}
+	if ((size_t)shard_num > block_num / BUDDY_MIN_SHARD_BLOCKS) {
+		shard_num = (int)(block_num / BUDDY_MIN_SHARD_BLOCKS);
+	}
+	if (shard_num < 1) {
+		shard_num = 1;
+	}
 
 	buddy_manager->starting_block_adr = first_block;
 	buddy_manager->number_of_blocks = block_num;
-	buddy_manager->largest_block_degree2 = (int)log2(previous_power_of_two(block_num));
+	buddy_manager->block_state = (unsigned char*)(buddy_manager + 1) + client_size;
+	memset(buddy_manager->block_state, 0, block_num);
 
-	for (int i = 0; i <= buddy_manager->largest_block_degree2; i++) {
-		buddy_manager->headers[i] = NULL;
+	buddy_manager->number_of_shards = shard_num;
+	buddy_manager->shard_size = block_num / shard_num / alignment_blocks * alignment_blocks;
+	if (!buddy_manager->shard_size) {
+		buddy_manager->shard_size = block_num / shard_num;
 	}
-
-	for (int i = 0; i < buddy_manager->number_of_blocks; i++) {
-		Block* block_to_add = buddy_manager->starting_block_adr + i;
-		put_buddy(block_to_add, 1);
+	buddy_manager->largest_block_degree2 = 0;
+	buddy_manager->release_order = -1;
+	buddy_manager->release_lazy = 0;
+	buddy_manager->release_granule = BLOCK_SIZE;
+	buddy_manager->released_blocks = 0;
+	for (int i = 0; i < shard_num; i++) {
+		size_t first = i * buddy_manager->shard_size;
+		size_t size = i == shard_num - 1 ? block_num - first : buddy_manager->shard_size;
+		init_buddy_shard(&buddy_manager->shards[i], first, size);
+		if (buddy_manager->shards[i].largest_block_degree2 > buddy_manager->largest_block_degree2) {
+			buddy_manager->largest_block_degree2 = buddy_manager->shards[i].largest_block_degree2;
+		}
 	}
 
-	buddy_manager->dhMutex = CreateMutex(NULL, FALSE, NULL);
+	// The page caches together hold at most 1/16 of the arena, each caches high runs of every order
+	int page_cache_num = processor_count();
+	if (page_cache_num > PAGE_CACHE_MAX_NUMBER) {
+		page_cache_num = PAGE_CACHE_MAX_NUMBER;
+	}
+	size_t high = block_num / (16 * (size_t)page_cache_num * ((2 << PAGE_CACHE_MAX_ORDER) - 1));
+	if (high > PAGE_CACHE_HIGH) {
+		high = PAGE_CACHE_HIGH;
+	}
+	buddy_manager->number_of_page_caches = page_cache_num;
+	buddy_manager->page_cache_high = high < 4 ? 0 : (int)high;
+	buddy_manager->page_cache_batch = (int)high / 4;
+	for (int i = 0; i < page_cache_num; i++) {
+		PageCache* cache = &buddy_manager->page_caches[i];
+		spin_lock_init(&cache->lock);
+		for (int index = 0; index <= PAGE_CACHE_MAX_ORDER; index++) {
+			cache->head[index] = cache->tail[index] = NULL;
+			cache->count[index] = 0;
+		}
+	}
 }
 
 
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// The ctest check of bulk allocation and freeing, its asserts stay on in optimized builds too
+#undef NDEBUG
+#include <assert.h>
+#include "buddy.h"
+#include "slab.h"
+
+#define BLOCK_NUMBER (1024)
+#define OBJECT_SIZE (200)		// small enough to keep the slab descriptors on the slabs
+#define OBJECT_NUMBER (2000)
+#define TOO_MANY_OBJECTS (BLOCK_NUMBER * (BLOCK_SIZE / OBJECT_SIZE))	// more than the whole arena holds
+
+static void* objects[TOO_MANY_OBJECTS];
+
+static int compare_pointers(const void* a, const void* b) {
+	char* first = *(char* const*)a;
+	char* second = *(char* const*)b;
+	return (first > second) - (first < second);
+}
+
+static size_t buddy_free_blocks() {
+	BuddyStats stats;
+	buddy_drain_page_caches();
+	get_buddy_stats(&stats);
+	return stats.free_blocks;
+}
+
+int main() {
+
+	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	kmem_init(space, BLOCK_NUMBER);
+
+	kmem_cache_t* cache = kmem_cache_create_flags("bulk_test", OBJECT_SIZE, NULL, NULL, KMEM_CACHE_NO_MERGE);
+	assert(cache);
+	size_t initial = buddy_free_blocks();
+
+	// A whole batch comes from the slabs at once, every object distinct and apart from the others
+	assert(kmem_cache_alloc_bulk(cache, objects, OBJECT_NUMBER) == OBJECT_NUMBER);
+	for (int i = 0; i < OBJECT_NUMBER; i++) {
+		assert(objects[i]);
+		memset(objects[i], i, OBJECT_SIZE);
+	}
+	qsort(objects, OBJECT_NUMBER, sizeof(void*), compare_pointers);
+	for (int i = 1; i < OBJECT_NUMBER; i++) {
+		assert((char*)objects[i] - (char*)objects[i - 1] >= OBJECT_SIZE);
+	}
+	kmem_cache_stats_t stats;
+	kmem_cache_get_stats(cache, &stats);
+	assert(stats.allocs == OBJECT_NUMBER && stats.active_objects == OBJECT_NUMBER && !stats.failures);
+	assert(buddy_free_blocks() == initial - stats.active_slabs * stats.slab_size_in_blocks);
+
+	// Freeing the batch and shrinking the cache gives the buddy allocator back every block
+	kmem_cache_free_bulk(cache, objects, OBJECT_NUMBER);
+	kmem_cache_get_stats(cache, &stats);
+	assert(stats.frees == OBJECT_NUMBER && stats.active_objects == 0);
+	assert(kmem_cache_shrink(cache) > 0);
+	assert(buddy_free_blocks() == initial);
+
+	// Out of memory the batch comes back short, with what could be had, and counts one failure
+	int allocated = kmem_cache_alloc_bulk(cache, objects, TOO_MANY_OBJECTS);
+	assert(allocated > 0 && allocated < TOO_MANY_OBJECTS);
+	for (int i = 0; i < allocated; i++) {
+		assert(objects[i]);
+	}
+	kmem_cache_get_stats(cache, &stats);
+	assert(stats.allocs == OBJECT_NUMBER + (unsigned long long)allocated && stats.failures == 1);
+	assert(!kmem_cache_alloc(cache));
+
+	// The arena's other caches may have given empty slabs back on the way, so there can be more than before
+	kmem_cache_free_bulk(cache, objects, allocated);
+	kmem_cache_shrink(cache);
+	assert(buddy_free_blocks() >= initial);
+	assert(kmem_cache_alloc_bulk(cache, objects, OBJECT_NUMBER) == OBJECT_NUMBER);
+	kmem_cache_free_bulk(cache, objects, OBJECT_NUMBER);
+
+	kmem_cache_destroy(cache);
+	free(space);
+
+	printf("bulk checks passed\n");
+	return 0;
+}
@@ -0,0 +1,104 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <vector>
+// The ctest check of h/kmem.hpp, its asserts stay on in optimized builds too
+#undef NDEBUG
+#include <cassert>
+#include "kmem.hpp"
+
+#define BLOCK_NUMBER (8192)
+
+struct session {
+	int id = -1;
+	char name[24] = "";
+};
+
+struct alignas(64) line {
+	char bytes[64];
+};
+
+static void check_object_cache() {
+	kmem::object_cache<session> sessions("kmem_test sessions");
+	std::vector<session*> live;
+	for (int i = 0; i < 1000; i++) {
+		session* s = sessions.allocate();
+		assert(s->id == -1 || s->id < i);
+		s->id = i;
+		live.push_back(s);
+	}
+	for (session* s : live) {
+		sessions.deallocate(s);
+	}
+
+	kmem::object_cache<line> lines("kmem_test lines");
+	line* l = lines.allocate();
+	assert(reinterpret_cast<std::uintptr_t>(l) % alignof(line) == 0);
+	lines.deallocate(l);
+}
+
+static void check_allocator() {
+	std::map<int, session, std::less<int>, kmem::allocator<std::pair<const int, session>>> sessions;
+	for (int i = 0; i < 10000; i++) {
+		sessions[i].id = i;
+	}
+	for (int i = 0; i < 10000; i += 2) {
+		sessions.erase(i);
+	}
+	assert(sessions.size() == 5000 && sessions.begin()->second.id == 1);
+
+	std::vector<line, kmem::allocator<line>> lines(100);
+	assert(reinterpret_cast<std::uintptr_t>(lines.data()) % alignof(line) == 0);
+}
+
+static void check_memory_resource() {
+#ifdef KMEM_HAS_MEMORY_RESOURCE
+	std::pmr::vector<int> numbers(kmem::kmalloc_memory_resource());
+	for (int i = 0; i < 100000; i++) {
+		numbers.push_back(i);
+	}
+	assert(numbers[99999] == 99999);
+
+	std::pmr::memory_resource* resource = kmem::kmalloc_memory_resource();
+	for (std::size_t align = 1; align <= BLOCK_SIZE; align <<= 1) {
+		for (std::size_t bytes : { 1, 40, 64, 1000, 8192, 8193, 20000 }) {
+			void* memory = resource->allocate(bytes, align);
+			assert(reinterpret_cast<std::uintptr_t>(memory) % align == 0);
+			resource->deallocate(memory, bytes, align);
+		}
+	}
+
+	// Small over-aligned requests come from a cache of their size class, not from whole blocks
+	std::vector<void*> lines;
+	for (int i = 0; i < 1000; i++) {
+		lines.push_back(resource->allocate(64, 64));
+	}
+	kmem_cache_stats_t stats[128];
+	int caches = kmem_stats_snapshot(stats, 128);
+	unsigned long long blocks = 0;
+	for (int i = 0; i < caches && i < 128; i++) {
+		if (!strcmp(stats[i].name, "kmem::aligned<64,64>")) {
+			blocks = stats[i].active_slabs * stats[i].slab_size_in_blocks;
+		}
+	}
+	assert(blocks > 0 && blocks < 1000 * 64 / BLOCK_SIZE * 2);
+	for (void* memory : lines) {
+		resource->deallocate(memory, 64, 64);
+	}
+#endif
+}
+
+int main() {
+	void* space = malloc(BLOCK_NUMBER * BLOCK_SIZE);
+	kmem_init(space, BLOCK_NUMBER);
+
+	check_object_cache();
+	check_allocator();
+	check_memory_resource();
+
+	printf("kmem.hpp checks passed\n");
+	return 0;
+}
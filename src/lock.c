@@ -0,0 +1,615 @@
+#include "lock.h"
+
+#ifdef _WIN32
+#pragma comment(lib, "Synchronization.lib")
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#endif
+
+#ifdef LOCK_STATS
+#include "utils.h"
+#include <stdint.h>
+
+// The plain locks are defined below, the instrumented call site wrappers at the end of the file are built on them
+#undef mutex_lock
+#undef mutex_try_lock
+#undef mutex_unlock
+#undef spin_lock
+#undef spin_unlock
+#endif
+
+#define MUTEX_SPIN_COUNT 128
+#define SPIN_LOCK_YIELD_COUNT 64
+#define LOCK_STATS_SITES 512	// open addressing table of call sites, sites past it share one overflow entry
+
+
+#ifdef __linux__
+static int futex_private = FUTEX_PRIVATE_FLAG;	// private futexes are keyed by address space and never wake another process
+#endif
+
+
+void lock_set_process_shared(int shared) {
+#ifdef __linux__
+	futex_private = shared ? 0 : FUTEX_PRIVATE_FLAG;
+#else
+	(void)shared;
+#endif
+}
+
+
+// Sleeps while *address == expected, may return spuriously
+static void wait_on_address(volatile int* address, int expected) {
+#ifdef _WIN32
+	WaitOnAddress(address, &expected, sizeof(int), INFINITE);
+#elif defined(__linux__)
+	syscall(SYS_futex, address, FUTEX_WAIT | futex_private, expected, NULL, NULL, 0);
+#else
+	if (*address == expected) {
+		thread_yield();
+	}
+#endif
+}
+
+
+static void wake_one(volatile int* address) {
+#ifdef _WIN32
+	WakeByAddressSingle((PVOID)address);
+#elif defined(__linux__)
+	syscall(SYS_futex, address, FUTEX_WAKE | futex_private, 1, NULL, NULL, 0);
+#endif
+}
+
+
+void mutex_init(Mutex* mutex) {
+	mutex->state = 0;
+#ifdef LOCK_STATS
+	mutex->holder = NULL;
+#endif
+}
+
+
+int mutex_try_lock(Mutex* mutex) {
+	return atomic_compare_exchange_int(&mutex->state, 0, 1) == 0;
+}
+
+
+void mutex_lock(Mutex* mutex) {
+
+	if (mutex_try_lock(mutex)) {
+		return;
+	}
+
+	// The holder is usually out of the critical section within a few hundred cycles, so spin before sleeping
+	for (int i = 0; i < MUTEX_SPIN_COUNT; i++) {
+		cpu_relax();
+		if (!atomic_load_int(&mutex->state) && mutex_try_lock(mutex)) {
+			return;
+		}
+	}
+
+	while (atomic_exchange_int(&mutex->state, 2)) {
+		wait_on_address(&mutex->state, 2);
+	}
+}
+
+
+void mutex_unlock(Mutex* mutex) {
+	if (atomic_exchange_int(&mutex->state, 0) == 2) {
+		wake_one(&mutex->state);
+	}
+}
+
+
+void spin_lock_init(SpinLock* lock) {
+	lock->locked = 0;
+#ifdef LOCK_STATS
+	lock->holder = NULL;
+#endif
+}
+
+
+void spin_lock(SpinLock* lock) {
+	int spins = 0;
+	while (atomic_exchange_int(&lock->locked, 1)) {
+		while (atomic_load_int(&lock->locked)) {
+			// The holder may have been preempted, give it the CPU back now and then
+			if (++spins % SPIN_LOCK_YIELD_COUNT == 0) {
+				thread_yield();
+			}
+			else {
+				cpu_relax();
+			}
+		}
+	}
+}
+
+
+void spin_unlock(SpinLock* lock) {
+	atomic_store_release_int(&lock->locked, 0);
+}
+
+
+// Threads start in a trampoline of the signature the OS expects, calling work through another type is undefined
+typedef struct ThreadStart {
+	void (*work)(void*);
+	void* data;
+} ThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(LPVOID arg) {
+#else
+static void* thread_main(void* arg) {
+#endif
+	ThreadStart start = *(ThreadStart*)arg;
+	free(arg);
+	start.work(start.data);
+	return 0;
+}
+
+
+int thread_create(Thread* thread, void(*work)(void*), void* data) {
+	ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+	if (!start) {
+		return -1;
+	}
+	start->work = work;
+	start->data = data;
+#ifdef _WIN32
+	*thread = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+	if (*thread) {
+		return 0;
+	}
+#else
+	if (!pthread_create(thread, NULL, thread_main, start)) {
+		return 0;
+	}
+#endif
+	free(start);
+	return -1;
+}
+
+
+void thread_join(Thread thread) {
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
+
+
+void thread_sleep_ms(int ms) {
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec duration = { ms / 1000, (long)(ms % 1000) * 1000000L };
+	nanosleep(&duration, NULL);
+#endif
+}
+
+
+unsigned monotonic_time_ms() {
+#ifdef _WIN32
+	return (unsigned)GetTickCount();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned)((unsigned long long)now.tv_sec * 1000ULL + (unsigned long long)now.tv_nsec / 1000000ULL);
+#endif
+}
+
+
+size_t vm_page_size() {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (size_t)info.dwPageSize;
+#else
+	long size = sysconf(_SC_PAGESIZE);
+	return size > 0 ? (size_t)size : 4096;
+#endif
+}
+
+
+void* vm_reserve(size_t* bytes, int* huge) {
+#ifdef _WIN32
+	if (*huge) {
+		size_t large_page = GetLargePageMinimum();
+		size_t size = large_page ? (*bytes + large_page - 1) / large_page * large_page : 0;
+		void* adr = size ? VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE) : NULL;
+		if (adr) {
+			*bytes = size;
+			return adr;
+		}
+		*huge = 0;
+	}
+	size_t page = vm_page_size();
+	*bytes = (*bytes + page - 1) / page * page;
+	return VirtualAlloc(NULL, *bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+#ifdef MAP_HUGETLB
+	if (*huge) {
+		size_t size = (*bytes + VM_HUGE_PAGE_SIZE - 1) / VM_HUGE_PAGE_SIZE * VM_HUGE_PAGE_SIZE;
+		void* adr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (adr != MAP_FAILED) {
+			*bytes = size;
+			return adr;
+		}
+	}
+#endif
+	int hint = *huge;
+	*huge = 0;
+	size_t page = vm_page_size();
+	size_t size = (*bytes + page - 1) / page * page;
+
+	// Over reserve so the arena can start on a huge page boundary, which transparent huge pages need
+	size_t slack = hint ? VM_HUGE_PAGE_SIZE : 0;
+	char* adr = (char*)mmap(NULL, size + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (adr == MAP_FAILED) {
+		return NULL;
+	}
+	if (slack) {
+		char* aligned = (char*)(((size_t)adr + VM_HUGE_PAGE_SIZE - 1) & ~(VM_HUGE_PAGE_SIZE - 1));
+		if (aligned > adr) {
+			munmap(adr, (size_t)(aligned - adr));
+		}
+		if (aligned + size < adr + size + slack) {
+			munmap(aligned + size, (size_t)(adr + size + slack - (aligned + size)));
+		}
+		adr = aligned;
+#ifdef MADV_HUGEPAGE
+		madvise(adr, size, MADV_HUGEPAGE);
+#endif
+	}
+	*bytes = size;
+	return adr;
+#endif
+}
+
+
+void vm_release(void* adr, size_t bytes) {
+#ifdef _WIN32
+	(void)bytes;
+	VirtualFree(adr, 0, MEM_RELEASE);
+#else
+	munmap(adr, bytes);
+#endif
+}
+
+
+// MEM_RESET on Windows either way, the pages keep their contents until the OS needs them
+void vm_discard(void* adr, size_t bytes, int lazy) {
+#ifdef _WIN32
+	(void)lazy;
+	VirtualAlloc(adr, bytes, MEM_RESET, PAGE_READWRITE);
+#else
+#ifdef MADV_FREE
+	if (lazy) {
+		madvise(adr, bytes, MADV_FREE);
+		return;
+	}
+#else
+	(void)lazy;
+#endif
+	madvise(adr, bytes, MADV_DONTNEED);
+#endif
+}
+
+
+int vm_shared_open(const char* name, size_t bytes, int create) {
+#ifdef _WIN32
+	(void)name;
+	(void)bytes;
+	(void)create;
+	return -1;
+#else
+	int handle = shm_open(name, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+	if (handle < 0) {
+		return -1;
+	}
+	if (create && ftruncate(handle, (off_t)bytes)) {
+		close(handle);
+		shm_unlink(name);
+		return -1;
+	}
+	return handle;
+#endif
+}
+
+
+void* vm_shared_map(int handle, size_t bytes, void* address) {
+#ifdef _WIN32
+	(void)handle;
+	(void)bytes;
+	(void)address;
+	return NULL;
+#else
+	int flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+	if (address) {
+		flags |= MAP_FIXED_NOREPLACE;
+	}
+#endif
+	void* adr = mmap(address, bytes, PROT_READ | PROT_WRITE, flags, handle, 0);
+	if (adr == MAP_FAILED) {
+		return NULL;
+	}
+	// Without MAP_FIXED_NOREPLACE the address is only a hint, and nothing mapped there may be replaced
+	if (address && adr != address) {
+		munmap(adr, bytes);
+		return NULL;
+	}
+	return adr;
+#endif
+}
+
+
+void vm_shared_close(int handle) {
+#ifndef _WIN32
+	close(handle);
+#else
+	(void)handle;
+#endif
+}
+
+
+int vm_shared_unlink(const char* name) {
+#ifdef _WIN32
+	(void)name;
+	return -1;
+#else
+	return shm_unlink(name);
+#endif
+}
+
+
+#ifdef LOCK_STATS
+
+static LockSite lock_sites[LOCK_STATS_SITES];
+static LockSite lock_site_overflow = { .file = "(other)", .function = "(other)", .line = 0, .ready = 1 };
+static SpinLock lock_sites_lock;
+
+
+static unsigned long long lock_stats_now() {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if (!frequency.QuadPart) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+	return (unsigned long long)(counter.QuadPart / frequency.QuadPart * 1000000000ULL + counter.QuadPart % frequency.QuadPart * 1000000000ULL / frequency.QuadPart);
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+#endif
+}
+
+
+static int lock_stats_bucket(unsigned long long ns) {
+	if (!ns) {
+		return 0;
+	}
+	int bucket = floor_log2(ns) + 1;
+	return bucket < LOCK_STATS_BUCKETS ? bucket : LOCK_STATS_BUCKETS - 1;
+}
+
+
+static void lock_stats_record(volatile unsigned long long* histogram, volatile unsigned long long* total, unsigned long long ns) {
+	atomic_add_ull(&histogram[lock_stats_bucket(ns)], 1);
+	atomic_add_ull(total, ns);
+}
+
+
+// Sites are looked up without a lock, a new one is published under lock_sites_lock
+static LockSite* lock_site_of(const char* file, int line, const char* function) {
+
+	unsigned first = (unsigned)(((uintptr_t)file >> 4) ^ (unsigned)line * 2654435761u) % LOCK_STATS_SITES;
+
+	for (int i = 0; i < LOCK_STATS_SITES; i++) {
+		LockSite* site = &lock_sites[(first + i) % LOCK_STATS_SITES];
+		if (!atomic_load_acquire_int(&site->ready)) {
+			break;
+		}
+		if (site->file == file && site->line == line) {
+			return site;
+		}
+	}
+
+	spin_lock(&lock_sites_lock);
+	LockSite* found = &lock_site_overflow;
+	for (int i = 0; i < LOCK_STATS_SITES; i++) {
+		LockSite* site = &lock_sites[(first + i) % LOCK_STATS_SITES];
+		if (!site->ready) {
+			site->file = file;
+			site->line = line;
+			site->function = function;
+			atomic_exchange_int(&site->ready, 1);
+			found = site;
+			break;
+		}
+		if (site->file == file && site->line == line) {
+			found = site;
+			break;
+		}
+	}
+	spin_unlock(&lock_sites_lock);
+	return found;
+}
+
+
+void mutex_lock_at(Mutex* mutex, const char* file, int line, const char* function) {
+
+	LockSite* site = lock_site_of(file, line, function);
+	unsigned long long start = lock_stats_now();
+	unsigned long long acquired = start;
+
+	if (!mutex_try_lock(mutex)) {
+		atomic_add_ull(&site->contended, 1);
+		mutex_lock(mutex);
+		acquired = lock_stats_now();
+	}
+
+	atomic_add_ull(&site->acquisitions, 1);
+	lock_stats_record(site->wait_histogram, &site->wait_total_ns, acquired - start);
+	mutex->holder = site;
+	mutex->acquired_at = acquired;
+}
+
+
+int mutex_try_lock_at(Mutex* mutex, const char* file, int line, const char* function) {
+
+	LockSite* site = lock_site_of(file, line, function);
+
+	if (!mutex_try_lock(mutex)) {
+		atomic_add_ull(&site->contended, 1);
+		return 0;
+	}
+
+	atomic_add_ull(&site->acquisitions, 1);
+	lock_stats_record(site->wait_histogram, &site->wait_total_ns, 0);
+	mutex->holder = site;
+	mutex->acquired_at = lock_stats_now();
+	return 1;
+}
+
+
+void mutex_unlock_at(Mutex* mutex) {
+
+	LockSite* site = mutex->holder;
+	if (site) {
+		mutex->holder = NULL;
+		lock_stats_record(site->hold_histogram, &site->hold_total_ns, lock_stats_now() - mutex->acquired_at);
+	}
+	mutex_unlock(mutex);
+}
+
+
+void spin_lock_at(SpinLock* lock, const char* file, int line, const char* function) {
+
+	LockSite* site = lock_site_of(file, line, function);
+	unsigned long long start = lock_stats_now();
+	unsigned long long acquired = start;
+
+	if (atomic_exchange_int(&lock->locked, 1)) {
+		atomic_add_ull(&site->contended, 1);
+		spin_lock(lock);
+		acquired = lock_stats_now();
+	}
+
+	atomic_add_ull(&site->acquisitions, 1);
+	lock_stats_record(site->wait_histogram, &site->wait_total_ns, acquired - start);
+	lock->holder = site;
+	lock->acquired_at = acquired;
+}
+
+
+void spin_unlock_at(SpinLock* lock) {
+
+	LockSite* site = lock->holder;
+	if (site) {
+		lock->holder = NULL;
+		lock_stats_record(site->hold_histogram, &site->hold_total_ns, lock_stats_now() - lock->acquired_at);
+	}
+	spin_unlock(lock);
+}
+
+
+// Upper bound of the bucket that holds the given quantile, in ns
+static unsigned long long lock_stats_quantile(volatile unsigned long long* histogram, unsigned long long count, double quantile) {
+	unsigned long long target = (unsigned long long)(count * quantile);
+	unsigned long long seen = 0;
+	for (int i = 0; i < LOCK_STATS_BUCKETS; i++) {
+		seen += atomic_load_ull(&histogram[i]);
+		if (seen > target) {
+			return i ? 1ULL << i : 0;
+		}
+	}
+	return 1ULL << (LOCK_STATS_BUCKETS - 1);
+}
+
+
+static void lock_stats_print_histogram(FILE* out, const char* label, volatile unsigned long long* histogram) {
+	fprintf(out, "    %s:", label);
+	for (int i = 0; i < LOCK_STATS_BUCKETS; i++) {
+		unsigned long long count = atomic_load_ull(&histogram[i]);
+		if (count) {
+			fprintf(out, " <%lluns:%llu", i ? 1ULL << i : 1ULL, count);
+		}
+	}
+	fprintf(out, "\n");
+}
+
+
+static int lock_site_compare(const void* first, const void* second) {
+	unsigned long long a = atomic_load_ull(&(*(LockSite* const*)first)->wait_total_ns);
+	unsigned long long b = atomic_load_ull(&(*(LockSite* const*)second)->wait_total_ns);
+	return a < b ? 1 : a > b ? -1 : 0;
+}
+
+
+void lock_stats_print(FILE* out) {
+
+	LockSite* sites[LOCK_STATS_SITES + 1];
+	int count = 0;
+	for (int i = 0; i < LOCK_STATS_SITES; i++) {
+		if (atomic_load_acquire_int(&lock_sites[i].ready)) {
+			sites[count++] = &lock_sites[i];
+		}
+	}
+	sites[count++] = &lock_site_overflow;
+	qsort(sites, count, sizeof(LockSite*), lock_site_compare);
+
+	fprintf(out, "\n~~~LOCK STATS~~~ (latencies are histogram bucket upper bounds)\n\n");
+	for (int i = 0; i < count; i++) {
+		LockSite* site = sites[i];
+		unsigned long long acquisitions = atomic_load_ull(&site->acquisitions);
+		unsigned long long contended = atomic_load_ull(&site->contended);
+		if (!acquisitions && !contended) {
+			continue;
+		}
+
+		fprintf(out, "%s (%s:%d)\n", site->function, site->file, site->line);
+		fprintf(out, "    acquisitions %llu, contended %llu, wait total %lluns p50 %lluns p99 %lluns, hold total %lluns p50 %lluns p99 %lluns\n",
+			acquisitions, contended,
+			atomic_load_ull(&site->wait_total_ns), lock_stats_quantile(site->wait_histogram, acquisitions, 0.5), lock_stats_quantile(site->wait_histogram, acquisitions, 0.99),
+			atomic_load_ull(&site->hold_total_ns), lock_stats_quantile(site->hold_histogram, acquisitions, 0.5), lock_stats_quantile(site->hold_histogram, acquisitions, 0.99));
+		lock_stats_print_histogram(out, "wait", site->wait_histogram);
+		lock_stats_print_histogram(out, "hold", site->hold_histogram);
+	}
+}
+
+
+static void lock_site_reset(LockSite* site) {
+	atomic_store_ull(&site->acquisitions, 0);
+	atomic_store_ull(&site->contended, 0);
+	atomic_store_ull(&site->wait_total_ns, 0);
+	atomic_store_ull(&site->hold_total_ns, 0);
+	for (int i = 0; i < LOCK_STATS_BUCKETS; i++) {
+		atomic_store_ull(&site->wait_histogram[i], 0);
+		atomic_store_ull(&site->hold_histogram[i], 0);
+	}
+}
+
+
+// Sites stay registered, only their counters start over
+void lock_stats_reset() {
+	for (int i = 0; i < LOCK_STATS_SITES; i++) {
+		lock_site_reset(&lock_sites[i]);
+	}
+	lock_site_reset(&lock_site_overflow);
+}
+
+#endif
@@ -1,6 +1,9 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+// The workload is the ctest check of the allocator, its asserts stay on in optimized builds too
+#undef NDEBUG
 #include <assert.h>
 #include "slab.h"
 #include "test.h"
@@ -13,13 +16,13 @@
 
 void construct(void* data) {
 	static int i = 1;
-	printf_s("%d Shared object constructed.\n", i++);
+	printf("%d Shared object constructed.\n", i++);
 	memset(data, MASK, shared_size);
 }
 
 int check(void* data, size_t size) {
 	int ret = 1;
-	for (int i = 0; i < size; i++) {
+	for (size_t i = 0; i < size; i++) {
 		if (((unsigned char*)data)[i] != MASK) {
 			ret = 0;
 		}
@@ -36,7 +39,7 @@ void work(void* pdata) {
 	struct data_s data = *(struct data_s*) pdata;
 	char buffer[1024];
 	int size = 0;
-	sprintf_s(buffer, 1024, "thread cache %d", data.id);
+	snprintf(buffer, 1024, "thread cache %d", data.id);
 	kmem_cache_t* cache = kmem_cache_create(buffer, data.id, 0, 0);
 
 	struct objects_s* objs = (struct objects_s*)(kmalloc(sizeof(struct objects_s) * data.iterations));
@@ -67,10 +70,25 @@ void work(void* pdata) {
 	kmem_cache_destroy(cache);
 }
 
-int main() {
+// Runs the workload on a malloc'ed arena, or with "arena" on one mapped from the OS that is released and mapped again
+int main(int argc, char** argv) {
+
+	int arena = argc > 1 && !strcmp(argv[1], "arena");
+	void* space = NULL;
+	if (arena) {
+		// Huge pages are only released whole, every one of a free run of 1024 blocks but the first goes back to the OS
+		if (kmem_init_arena(BLOCK_NUMBER, KMEM_ARENA_HUGE_PAGES, 10)) {
+			return 1;
+		}
+	}
+	else {
+		space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+		kmem_init(space, BLOCK_NUMBER);
+	}
+	// Sizes that wrap around when rounded up to blocks
+	assert(!kmalloc(SIZE_MAX));
+	assert(!kmalloc(SIZE_MAX - 4000));
 
-	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
-	kmem_init(space, BLOCK_NUMBER);
 	kmem_cache_t* shared = kmem_cache_create("shared object", shared_size, construct, NULL);
 
 	struct data_s data;
@@ -79,6 +97,20 @@ int main() {
 	run_threads(work, &data, THREAD_NUM);
 
 	kmem_cache_destroy(shared);
+
+	if (arena) {
+		kmem_release_arena();
+		kmem_release_arena();
+
+		// The released allocator keeps nothing of the old arena
+		assert(!kmem_init_arena(BLOCK_NUMBER, 0, -1));
+		kmem_cache_t* cache = kmem_cache_create("after release", 64, NULL, NULL);
+		void* object = kmem_cache_alloc(cache);
+		assert(object);
+		kmem_cache_free(cache, object);
+		kmem_cache_destroy(cache);
+		kmem_release_arena();
+	}
 	free(space);
 
 	return 0;
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// The ctest check of cache merging, its asserts stay on in optimized builds too
+#undef NDEBUG
+#include <assert.h>
+#include "slab.h"
+
+#define BLOCK_NUMBER (8192)
+#define OBJECT_NUMBER (1000)
+
+static void construct(void* object) {
+	memset(object, 0, 24);
+}
+
+static void get_stats(const char* name, kmem_cache_stats_t* stats) {
+	kmem_cache_stats_t all[256];
+	int count = kmem_stats_snapshot(all, 256);
+	for (int i = 0; i < count && i < 256; i++) {
+		if (!strcmp(all[i].name, name)) {
+			*stats = all[i];
+			return;
+		}
+	}
+	assert(!"no such cache");
+}
+
+int main() {
+
+	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	kmem_init(space, BLOCK_NUMBER);
+
+	// 20 and 24 bytes both round up to 24 and share one cache, the others keep slabs of their own
+	kmem_cache_t* first = kmem_cache_create("merge_test first", 20, NULL, NULL);
+	kmem_cache_t* second = kmem_cache_create("merge_test second", 24, NULL, NULL);
+	kmem_cache_t* unmerged = kmem_cache_create_flags("merge_test unmerged", 24, NULL, NULL, KMEM_CACHE_NO_MERGE);
+	kmem_cache_t* constructed = kmem_cache_create("merge_test constructed", 24, construct, NULL);
+	kmem_cache_t* aligned = kmem_cache_create_aligned("merge_test aligned", 24, 64, NULL, NULL, 0);
+	assert(first && second && unmerged && constructed && aligned);
+	assert(kmem_cache_find("merge_test second") == second);
+
+	kmem_cache_stats_t stats;
+	kmem_cache_get_stats(first, &stats);
+	char shared_name[sizeof(stats.merged_into)];
+	strcpy(shared_name, stats.merged_into);
+	assert(shared_name[0]);
+	kmem_cache_get_stats(second, &stats);
+	assert(!strcmp(stats.merged_into, shared_name));
+	kmem_cache_t* unshared[] = { unmerged, constructed, aligned };
+	for (int i = 0; i < 3; i++) {
+		kmem_cache_get_stats(unshared[i], &stats);
+		assert(!stats.merged_into[0]);
+	}
+	// Aliases are small descriptors of their own cache
+	get_stats("alias_cache", &stats);
+	assert(stats.active_objects == 2);
+
+	// Each alias counts its own objects, the shared cache counts all of them and owns the slabs
+	static void* objects[OBJECT_NUMBER];
+	for (int i = 0; i < OBJECT_NUMBER; i++) {
+		objects[i] = kmem_cache_alloc(i % 4 ? first : second);
+		assert(objects[i]);
+		memset(objects[i], i, 20);
+	}
+	kmem_cache_get_stats(first, &stats);
+	assert(stats.allocs == OBJECT_NUMBER / 4 * 3 && stats.active_objects == OBJECT_NUMBER / 4 * 3);
+	assert(stats.active_slabs == 0);
+	kmem_cache_get_stats(second, &stats);
+	assert(stats.allocs == OBJECT_NUMBER / 4 && stats.active_objects == OBJECT_NUMBER / 4);
+	get_stats(shared_name, &stats);
+	assert(stats.allocs == OBJECT_NUMBER && stats.active_slabs > 0);
+
+	// Destroying one alias leaves the shared cache to the other
+	for (int i = 0; i < OBJECT_NUMBER; i += 4) {
+		kmem_cache_free(second, objects[i]);
+	}
+	kmem_cache_destroy(second);
+	for (int i = 0; i < OBJECT_NUMBER; i++) {
+		if (i % 4) {
+			assert(*(unsigned char*)objects[i] == (unsigned char)i);
+			kmem_cache_free(first, objects[i]);
+		}
+	}
+	get_stats(shared_name, &stats);
+	assert(stats.active_objects == 0);
+	get_stats("alias_cache", &stats);
+	assert(stats.active_objects == 1);
+
+	kmem_cache_destroy(first);
+	kmem_cache_destroy(unmerged);
+	kmem_cache_destroy(constructed);
+	kmem_cache_destroy(aligned);
+	assert(!kmem_cache_find("merge_test first"));
+	free(space);
+
+	printf("merge checks passed\n");
+	return 0;
+}
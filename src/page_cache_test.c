@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+// The ctest check of the per-processor page caches, its asserts stay on in optimized builds too
+#undef NDEBUG
+#include <assert.h>
+#include "buddy.h"
+
+#define BLOCK_NUMBER (16384)
+#define SMALL_BLOCK_NUMBER (128)	// page_cache_high comes out below 4 on any processor count
+
+static Block* runs[BLOCK_NUMBER];
+
+int main() {
+
+	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	init_buddy_manager(space, BLOCK_NUMBER, 0, 1, BLOCK_SIZE);
+	BuddyManager* manager = get_buddy_manager();
+	assert(manager->page_cache_high >= 4 && manager->page_cache_batch >= 1);
+
+	BuddyStats initial, stats;
+	get_buddy_stats(&initial);
+	unsigned long long initial_orders = manager->shards[0].nonempty_orders;
+	assert(initial.cached_blocks == 0);
+
+	// An empty page cache takes a batch from the shard and keeps all of it but the run handed out
+	Block* block = get_buddy(1);
+	assert(block);
+	get_buddy_stats(&stats);
+	assert(stats.cached_blocks == (size_t)manager->page_cache_batch - 1);
+	assert(stats.free_blocks == initial.free_blocks - manager->page_cache_batch);
+
+	// Freed runs go back to the hot end and are the first ones handed out again
+	put_buddy(block, 1);
+	get_buddy_stats(&stats);
+	assert(stats.cached_blocks == (size_t)manager->page_cache_batch);
+	assert(get_buddy(1) == block);
+	put_buddy(block, 1);
+
+	// Runs of two blocks have a list of their own
+	Block* pair = get_buddy(2);
+	assert(pair);
+	put_buddy(pair, 2);
+	get_buddy_stats(&stats);
+	assert(stats.cached_blocks == (size_t)manager->page_cache_batch * 3);
+
+	// Past page_cache_high the coldest runs go back to the shard, the cache does not grow with the freed blocks
+	int count = 0;
+	for (; count < 4 * manager->page_cache_high; count++) {
+		runs[count] = get_buddy(1);
+		assert(runs[count]);
+	}
+	while (count) {
+		put_buddy(runs[--count], 1);
+	}
+	get_buddy_stats(&stats);
+	assert(stats.cached_blocks <= (size_t)manager->page_cache_high + 2 * manager->page_cache_batch);
+
+	buddy_drain_page_caches();
+	get_buddy_stats(&stats);
+	assert(stats.cached_blocks == 0 && stats.free_blocks == initial.free_blocks);
+	assert(manager->shards[0].nonempty_orders == initial_orders);
+
+	// Every run can still be had, the caches give theirs back once the shard is empty
+	while ((runs[count] = get_buddy(1))) {
+		count++;
+	}
+	assert((size_t)count == initial.free_blocks);
+	while (count) {
+		put_buddy(runs[--count], 1);
+	}
+	buddy_drain_page_caches();
+	assert(manager->shards[0].nonempty_orders == initial_orders);
+
+	// Too small an arena to spare blocks for the caches
+	init_buddy_manager(space, SMALL_BLOCK_NUMBER, 0, 1, BLOCK_SIZE);
+	assert(get_buddy_manager()->page_cache_high == 0);
+	get_buddy_stats(&initial);
+	block = get_buddy(1);
+	assert(block);
+	put_buddy(block, 1);
+	get_buddy_stats(&stats);
+	assert(stats.cached_blocks == 0 && stats.free_blocks == initial.free_blocks);
+
+	free(space);
+
+	printf("page cache checks passed\n");
+	return 0;
+}
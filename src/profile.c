@@ -0,0 +1,268 @@
+#include "profile.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define PROFILE_BACKTRACE 1
+#else
+#define PROFILE_BACKTRACE 0
+#endif
+
+// The tables live outside the arena in C library memory, so recording a sample never calls back into the allocator.
+// They belong to this process, even for a shared arena.
+
+typedef struct profile_stack {
+	struct profile_stack* next;
+	unsigned long long hash;
+	int depth;
+	void* frames[PROFILE_MAX_DEPTH];
+	unsigned long long alloc_objects;	// sampled since kmem_profile_start
+	unsigned long long alloc_bytes;
+	unsigned long long live_objects;	// sampled and not freed yet
+	unsigned long long live_bytes;
+} ProfileStack;
+
+typedef struct profile_sample {
+	struct profile_sample* next;
+	const void* object;
+	size_t size;
+	ProfileStack* stack;
+} ProfileSample;
+
+THREAD_LOCAL long long profile_bytes_until_sample = 0;	// the first allocation of a thread sets it up
+volatile int profile_live_samples = 0;
+
+static THREAD_LOCAL unsigned long long profile_random_state = 0;
+static volatile unsigned long long profile_sample_bytes = 0;	// 0 while stopped
+static size_t profile_period = PROFILE_DEFAULT_SAMPLE_BYTES;	// of the samples in the tables
+static Mutex profile_mutex;		// zero is unlocked, so it needs no initialization
+static ProfileSample* volatile profile_samples[PROFILE_SAMPLE_BUCKETS];	// heads are peeked at without the mutex
+static ProfileStack* profile_stacks[PROFILE_STACK_BUCKETS];
+
+
+static unsigned long long profile_random() {
+	if (!profile_random_state) {
+		profile_random_state = ((unsigned long long)(size_t)&profile_random_state ^ monotonic_time_ms()) | 1;
+	}
+	profile_random_state ^= profile_random_state << 13;
+	profile_random_state ^= profile_random_state >> 7;
+	profile_random_state ^= profile_random_state << 17;
+	return profile_random_state;
+}
+
+
+// Exponentially distributed with mean sample_bytes, the gaps of a Poisson process over the allocated bytes
+static long long next_sample_interval(unsigned long long sample_bytes) {
+	double uniform = ((double)(profile_random() >> 11) + 1.0) / 9007199254740992.0;	// (0, 1]
+	double interval = -log(uniform) * (double)sample_bytes;
+	return interval < 1.0 ? 1 : interval > 1e18 ? (long long)1e18 : (long long)interval;
+}
+
+
+static unsigned object_bucket(const void* object) {
+	return (unsigned)(((unsigned long long)(size_t)object >> 4) * 0x9e3779b97f4a7c15ULL >> 52) % PROFILE_SAMPLE_BUCKETS;
+}
+
+
+// Callers must hold profile_mutex
+static ProfileStack* find_stack(void** frames, int depth) {
+
+	unsigned long long hash = 1469598103934665603ULL;
+	for (int i = 0; i < depth; i++) {
+		hash = (hash ^ (unsigned long long)(size_t)frames[i]) * 1099511628211ULL;
+	}
+
+	ProfileStack** head = &profile_stacks[hash % PROFILE_STACK_BUCKETS];
+	for (ProfileStack* stack = *head; stack; stack = stack->next) {
+		if (stack->hash == hash && stack->depth == depth && !memcmp(stack->frames, frames, sizeof(void*) * depth)) {
+			return stack;
+		}
+	}
+
+	ProfileStack* stack = (ProfileStack*)calloc(1, sizeof(ProfileStack));
+	if (!stack) {
+		return NULL;
+	}
+	stack->hash = hash;
+	stack->depth = depth;
+	memcpy(stack->frames, frames, sizeof(void*) * depth);
+	stack->next = *head;
+	*head = stack;
+	return stack;
+}
+
+
+// Slow path of profile_alloc, the countdown of this thread ran out
+void profile_sample(void* object, size_t size) {
+
+	unsigned long long sample_bytes = atomic_load_ull(&profile_sample_bytes);
+	if (!sample_bytes) {
+		profile_bytes_until_sample = PROFILE_RECHECK_BYTES;
+		return;
+	}
+	profile_bytes_until_sample = next_sample_interval(sample_bytes);
+	if (!object) {
+		return;
+	}
+
+	// Captured right here so that skipping this one frame leaves the allocator entry point first, however inlined
+	void* frames[PROFILE_MAX_DEPTH + 1];
+#ifdef _WIN32
+	int depth = (int)CaptureStackBackTrace(1, PROFILE_MAX_DEPTH, frames + 1, NULL);
+#elif PROFILE_BACKTRACE
+	int depth = backtrace(frames, PROFILE_MAX_DEPTH + 1) - 1;
+#else
+	int depth = 0;
+#endif
+	if (depth < 0) {
+		depth = 0;
+	}
+	ProfileSample* sample = (ProfileSample*)malloc(sizeof(ProfileSample));
+	if (!sample) {
+		return;
+	}
+	sample->object = object;
+	sample->size = size;
+
+	mutex_lock(&profile_mutex);
+	sample->stack = find_stack(frames + 1, depth);
+	if (!sample->stack) {
+		mutex_unlock(&profile_mutex);
+		free(sample);
+		return;
+	}
+	sample->stack->alloc_objects++;
+	sample->stack->alloc_bytes += size;
+	sample->stack->live_objects++;
+	sample->stack->live_bytes += size;
+
+	ProfileSample* volatile* head = &profile_samples[object_bucket(object)];
+	sample->next = *head;
+	atomic_exchange_ptr((void* volatile*)head, sample);
+	atomic_fetch_add_int(&profile_live_samples, 1);
+	mutex_unlock(&profile_mutex);
+}
+
+
+// Slow path of profile_free, some object is sampled, most likely not this one
+void profile_forget(const void* object) {
+
+	ProfileSample* volatile* head = &profile_samples[object_bucket(object)];
+	if (!atomic_load_ptr((void* volatile*)head)) {
+		return;
+	}
+
+	mutex_lock(&profile_mutex);
+	ProfileSample* prev = NULL;
+	ProfileSample* sample = *head;
+	while (sample && sample->object != object) {
+		prev = sample;
+		sample = sample->next;
+	}
+	if (sample) {
+		if (prev) {
+			prev->next = sample->next;
+		}
+		else {
+			atomic_exchange_ptr((void* volatile*)head, sample->next);
+		}
+		sample->stack->live_objects--;
+		sample->stack->live_bytes -= sample->size;
+		atomic_fetch_add_int(&profile_live_samples, -1);
+	}
+	mutex_unlock(&profile_mutex);
+	free(sample);
+}
+
+
+// Every thread picks up the new rate once its current countdown runs out
+void kmem_profile_start(size_t sample_bytes) {
+
+	if (!sample_bytes) {
+		sample_bytes = PROFILE_DEFAULT_SAMPLE_BYTES;
+	}
+
+	mutex_lock(&profile_mutex);
+	for (int i = 0; i < PROFILE_SAMPLE_BUCKETS; i++) {
+		ProfileSample* sample = profile_samples[i];
+		atomic_exchange_ptr((void* volatile*)&profile_samples[i], NULL);
+		while (sample) {
+			ProfileSample* next = sample->next;
+			free(sample);
+			sample = next;
+		}
+	}
+	for (int i = 0; i < PROFILE_STACK_BUCKETS; i++) {
+		while (profile_stacks[i]) {
+			ProfileStack* next = profile_stacks[i]->next;
+			free(profile_stacks[i]);
+			profile_stacks[i] = next;
+		}
+	}
+	atomic_exchange_int(&profile_live_samples, 0);
+	profile_period = sample_bytes;
+	atomic_store_ull(&profile_sample_bytes, sample_bytes);
+	mutex_unlock(&profile_mutex);
+}
+
+
+// The samples taken so far stay for kmem_profile_dump, frees keep updating them
+void kmem_profile_stop() {
+	atomic_store_ull(&profile_sample_bytes, 0);
+}
+
+
+static void dump_mapped_libraries(FILE* out) {
+#ifdef __linux__
+	FILE* maps = fopen("/proc/self/maps", "r");
+	if (!maps) {
+		return;
+	}
+	char line[512];
+	fprintf(out, "\nMAPPED_LIBRARIES:\n");
+	while (fgets(line, sizeof(line), maps)) {
+		fputs(line, out);
+	}
+	fclose(maps);
+#else
+	(void)out;
+#endif
+}
+
+
+// Legacy gperftools heap profile with raw sample counts, pprof scales them back up from the heap_v2 period.
+// Every line has the live objects and bytes, then the ones allocated since kmem_profile_start, so the same file
+// gives the live heap (-inuse_space) and the allocation profile (-alloc_space).
+int kmem_profile_dump(const char* path) {
+
+	FILE* out = fopen(path, "w");
+	if (!out) {
+		return -1;
+	}
+
+	mutex_lock(&profile_mutex);
+	unsigned long long totals[4] = { 0, 0, 0, 0 };
+	for (int i = 0; i < PROFILE_STACK_BUCKETS; i++) {
+		for (ProfileStack* stack = profile_stacks[i]; stack; stack = stack->next) {
+			totals[0] += stack->live_objects;
+			totals[1] += stack->live_bytes;
+			totals[2] += stack->alloc_objects;
+			totals[3] += stack->alloc_bytes;
+		}
+	}
+	fprintf(out, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n", totals[0], totals[1], totals[2], totals[3], profile_period);
+	for (int i = 0; i < PROFILE_STACK_BUCKETS; i++) {
+		for (ProfileStack* stack = profile_stacks[i]; stack; stack = stack->next) {
+			fprintf(out, "%llu: %llu [%llu: %llu] @", stack->live_objects, stack->live_bytes, stack->alloc_objects, stack->alloc_bytes);
+			for (int frame = 0; frame < stack->depth; frame++) {
+				fprintf(out, " 0x%llx", (unsigned long long)(size_t)stack->frames[frame]);
+			}
+			fprintf(out, "\n");
+		}
+	}
+	mutex_unlock(&profile_mutex);
+
+	dump_mapped_libraries(out);
+	return fclose(out) ? -1 : 0;
+}
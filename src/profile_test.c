@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// The ctest check of the heap profiler, its asserts stay on in optimized builds too
+#undef NDEBUG
+#include <assert.h>
+#include "slab.h"
+
+#define BLOCK_NUMBER (8192)
+#define SAMPLE_BYTES (64 << 10)
+#define OBJECT_SIZE (1000)
+#define OBJECT_NUMBER (4096)
+
+static const char profile_path[] = "profile_test.heap";
+
+typedef struct profile_header {
+	unsigned long long live_objects;
+	unsigned long long live_bytes;
+	unsigned long long alloc_objects;
+	unsigned long long alloc_bytes;
+	size_t period;
+	int stacks;		// sample lines under the header
+	int mapped_libraries;
+} ProfileHeader;
+
+static void read_profile(ProfileHeader* header) {
+
+	memset(header, 0, sizeof(*header));
+	assert(!kmem_profile_dump(profile_path));
+	FILE* in = fopen(profile_path, "r");
+	assert(in);
+	char line[512];
+	assert(fgets(line, sizeof(line), in));
+	assert(sscanf(line, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu", &header->live_objects, &header->live_bytes,
+		&header->alloc_objects, &header->alloc_bytes, &header->period) == 5);
+	while (fgets(line, sizeof(line), in)) {
+		if (strstr(line, "] @ 0x")) {
+			header->stacks++;
+		}
+		if (!strcmp(line, "MAPPED_LIBRARIES:\n")) {
+			header->mapped_libraries = 1;
+		}
+	}
+	fclose(in);
+	remove(profile_path);
+}
+
+int main() {
+
+	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	kmem_init(space, BLOCK_NUMBER);
+
+	static void* objects[OBJECT_NUMBER];
+	kmem_profile_start(SAMPLE_BYTES);
+	for (int i = 0; i < OBJECT_NUMBER; i++) {
+		objects[i] = kmalloc(OBJECT_SIZE);
+		assert(objects[i]);
+	}
+
+	// About one sample per SAMPLE_BYTES allocated, 62 expected here, each counted at the size asked for
+	ProfileHeader header;
+	read_profile(&header);
+	unsigned long long expected = (unsigned long long)OBJECT_NUMBER * OBJECT_SIZE / SAMPLE_BYTES;
+	assert(header.period == SAMPLE_BYTES);
+	assert(header.alloc_objects >= expected / 2 && header.alloc_objects <= expected * 2);
+	assert(header.alloc_bytes == header.alloc_objects * OBJECT_SIZE);
+	assert(header.live_objects == header.alloc_objects && header.live_bytes == header.alloc_bytes);
+	assert(header.stacks > 0);
+#ifdef __linux__
+	assert(header.mapped_libraries);
+#endif
+
+	// Freed samples leave the live totals but stay allocated, also once sampling stopped
+	kmem_profile_stop();
+	for (int i = 0; i < OBJECT_NUMBER; i++) {
+		kfree(objects[i]);
+	}
+	ProfileHeader after;
+	read_profile(&after);
+	assert(after.live_objects == 0 && after.live_bytes == 0);
+	assert(after.alloc_objects == header.alloc_objects && after.alloc_bytes == header.alloc_bytes);
+
+	free(space);
+
+	printf("profile checks passed\n");
+	return 0;
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+// The ctest check of the background reaper, its asserts stay on in optimized builds too
+#undef NDEBUG
+#include <assert.h>
+#include "lock.h"
+#include "slab.h"
+
+#define BLOCK_NUMBER (8192)
+#define OBJECT_NUMBER (4096)
+#define WARM_SLABS (2)
+#define IDLE_MS (50)
+
+int main() {
+
+	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	kmem_init(space, BLOCK_NUMBER);
+
+	kmem_cache_t* cache = kmem_cache_create_flags("reaper_test", 256, NULL, NULL, KMEM_CACHE_NO_MERGE);
+	kmem_cache_set_magazine_size(cache, 0);
+	kmem_cache_set_reap_policy(cache, WARM_SLABS, IDLE_MS);
+
+	assert(!kmem_reaper_start(10));
+	assert(kmem_reaper_start(10) == -1);
+
+	static void* objects[OBJECT_NUMBER];
+	for (int i = 0; i < OBJECT_NUMBER; i++) {
+		objects[i] = kmem_cache_alloc(cache);
+		assert(objects[i]);
+	}
+	for (int i = 0; i < OBJECT_NUMBER; i++) {
+		kmem_cache_free(cache, objects[i]);
+	}
+	kmem_cache_stats_t stats;
+	kmem_cache_get_stats(cache, &stats);
+	unsigned long long grown = stats.active_slabs;
+	assert(grown > WARM_SLABS);
+
+	// Every empty slab but the warm ones goes back once idle, give the reaper a few seconds on a loaded machine
+	for (int waited = 0; waited < 5000 && stats.active_slabs > WARM_SLABS; waited += IDLE_MS) {
+		thread_sleep_ms(IDLE_MS);
+		kmem_cache_get_stats(cache, &stats);
+	}
+	assert(stats.active_slabs == WARM_SLABS);
+
+	unsigned long long reaped = kmem_reaper_stop();
+	assert(reaped >= (grown - WARM_SLABS) * stats.slab_size_in_blocks);
+	assert(reaped == kmem_reaped_blocks());
+	assert(kmem_reaper_stop() == reaped);
+
+	kmem_cache_destroy(cache);
+	free(space);
+
+	printf("reaper checks passed\n");
+	return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+// The ctest check of reclaim under memory pressure, its asserts stay on in optimized builds too
+#undef NDEBUG
+#include <assert.h>
+#include "buddy.h"
+#include "slab.h"
+
+#define BLOCK_NUMBER (1024)
+#define HELD_SLABS (4)
+#define SHRUNK_SLABS (3)
+
+static kmem_cache_t* held_cache;
+static void* held[BLOCK_NUMBER * BLOCK_SIZE / 256];
+static int held_count;
+static int shrink_objects;
+static int shrinker_calls;
+
+// Gives back the most recently allocated objects, they land in the magazines of held_cache rather than in its slabs
+size_t shrink(size_t blocks_wanted, void* data) {
+	(void)blocks_wanted;
+	assert(data == &held_count);
+	shrinker_calls++;
+	int freed = 0;
+	while (held_count && freed < shrink_objects) {
+		kmem_cache_free(held_cache, held[--held_count]);
+		freed++;
+	}
+	return freed;
+}
+
+int main() {
+
+	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	kmem_init(space, BLOCK_NUMBER);
+
+	held_cache = kmem_cache_create_flags("reclaim_test held", 256, NULL, NULL, KMEM_CACHE_NO_MERGE);
+	kmem_cache_set_magazine_size(held_cache, 64);
+	kmem_cache_t* blocked = kmem_cache_create_flags("reclaim_test blocked", 256, NULL, NULL, KMEM_CACHE_NO_MERGE);
+
+	kmem_cache_stats_t stats;
+	kmem_cache_get_stats(held_cache, &stats);
+	for (held_count = 0; held_count < HELD_SLABS * stats.objects_per_slab; held_count++) {
+		held[held_count] = kmem_cache_alloc(held_cache);
+		assert(held[held_count]);
+	}
+	shrink_objects = SHRUNK_SLABS * stats.objects_per_slab;
+	// The objects left in the magazines go back to their slabs, so only the shrinker can empty a slab
+	kmem_cache_shrink(held_cache);
+
+	// Take every free block behind the allocator's back, nothing but the shrinker can give memory back now
+	buddy_drain_page_caches();
+	Block* taken = NULL;
+	Block* block;
+	while ((block = get_buddy(1))) {
+		block->next = taken;
+		taken = block;
+	}
+
+	assert(!kmem_register_shrinker(shrink, &held_count));
+	void* object = kmem_cache_alloc(blocked);
+	assert(shrinker_calls > 0);
+	assert(object);
+	kmem_unregister_shrinker(shrink, &held_count);
+
+	kmem_cache_free(blocked, object);
+	while (taken) {
+		block = taken;
+		taken = taken->next;
+		put_buddy(block, 1);
+	}
+	while (held_count) {
+		kmem_cache_free(held_cache, held[--held_count]);
+	}
+	kmem_cache_destroy(blocked);
+	kmem_cache_destroy(held_cache);
+	free(space);
+
+	printf("reclaim checks passed\n");
+	return 0;
+}
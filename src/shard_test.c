@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+// The ctest check of the buddy shards and stealing between them, its asserts stay on in optimized builds too
+#undef NDEBUG
+#include <assert.h>
+#include "buddy.h"
+#include "lock.h"
+
+#define SHARD_NUMBER (4)
+#define BLOCK_NUMBER (SHARD_NUMBER * BUDDY_MIN_SHARD_BLOCKS + 777)	// the manager's blocks come out of the extra ones
+#define RUN_SIZE (4)		// larger than the page caches take, so every run comes from the shards
+
+static Block* runs[BLOCK_NUMBER / RUN_SIZE];
+
+static int shard_index_of(Block* block) {
+	BuddyManager* manager = get_buddy_manager();
+	size_t index = (size_t)(block - manager->starting_block_adr) / manager->shard_size;
+	return index < (size_t)manager->number_of_shards ? (int)index : manager->number_of_shards - 1;
+}
+
+// Run on a thread of its own, so it takes a home shard of its own
+static void take_run(void* data) {
+	int* shard = (int*)data;
+	Block* block = get_buddy(RUN_SIZE);
+	assert(block);
+	*shard = shard_index_of(block);
+	put_buddy(block, RUN_SIZE);
+}
+
+int main() {
+
+	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	init_buddy_manager(space, BLOCK_NUMBER, 0, SHARD_NUMBER, BLOCK_SIZE);
+	BuddyManager* manager = get_buddy_manager();
+	assert(manager->number_of_shards == SHARD_NUMBER);
+	unsigned long long initial_orders[SHARD_NUMBER];
+	for (int i = 0; i < SHARD_NUMBER; i++) {
+		initial_orders[i] = manager->shards[i].nonempty_orders;
+		assert(initial_orders[i] >> 2);
+	}
+
+	// Threads get home shards round robin, so as many threads as shards take their first runs from different shards
+	int homes[SHARD_NUMBER];
+	int seen = 0;
+	for (int i = 0; i < SHARD_NUMBER; i++) {
+		Thread thread;
+		assert(!thread_create(&thread, take_run, &homes[i]));
+		thread_join(thread);
+		seen |= 1 << homes[i];
+	}
+	assert(seen == (1 << SHARD_NUMBER) - 1);
+
+	// One thread gets every run once its home shard is empty, stealing the rest from the others
+	BuddyStats initial;
+	get_buddy_stats(&initial);
+	int count = 0;
+	int taken[SHARD_NUMBER] = { 0 };
+	while ((runs[count] = get_buddy(RUN_SIZE))) {
+		taken[shard_index_of(runs[count])]++;
+		count++;
+	}
+	size_t expected = 0;
+	for (int index = 2; index <= initial.largest_block_degree2; index++) {
+		expected += (size_t)initial.orders[index].free_blocks << (index - 2);
+	}
+	assert((size_t)count == expected);
+	for (int i = 0; i < SHARD_NUMBER; i++) {
+		assert(taken[i] > 0);
+		assert(!(manager->shards[i].nonempty_orders >> 2));
+	}
+
+	// Stolen runs go back to the shard they came from and merge there again
+	while (count) {
+		put_buddy(runs[--count], RUN_SIZE);
+	}
+	BuddyStats stats;
+	get_buddy_stats(&stats);
+	assert(stats.free_blocks == initial.free_blocks);
+	for (int i = 0; i < SHARD_NUMBER; i++) {
+		assert(manager->shards[i].nonempty_orders == initial_orders[i]);
+	}
+
+	// Every shard keeps at least BUDDY_MIN_SHARD_BLOCKS blocks, no matter how many were asked for
+	init_buddy_manager(space, 2 * BUDDY_MIN_SHARD_BLOCKS + 777, 0, 8, BLOCK_SIZE);
+	assert(get_buddy_manager()->number_of_shards == 2);
+	init_buddy_manager(space, BUDDY_MIN_SHARD_BLOCKS, 0, 8, BLOCK_SIZE);
+	assert(get_buddy_manager()->number_of_shards == 1);
+
+	free(space);
+
+	printf("shard checks passed\n");
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+// The ctest check of the shared arena across processes, its asserts stay on in optimized builds too
+#undef NDEBUG
+#include <assert.h>
+#include "slab.h"
+
+#define BLOCK_NUMBER (4096)
+
+typedef struct message {
+	int from;
+	char text[60];
+} Message;
+
+static void construct(void* object) {
+	memset(object, 0, sizeof(Message));
+}
+
+// Attaches the arena, answers the parent's message with one of its own and leaves the arena to the parent
+static int child(const char* name, int to_child, int to_parent) {
+
+	Message* received;
+	if (read(to_child, &received, sizeof(received)) != sizeof(received)) {
+		return 1;
+	}
+	if (kmem_shared_attach(name)) {
+		return 2;
+	}
+	kmem_cache_t* messages = kmem_cache_find("shared_test messages");
+	if (!messages || received->from != getppid() || strcmp(received->text, "ping")) {
+		return 3;
+	}
+
+	Message* reply = (Message*)kmem_cache_alloc(messages);
+	if (!reply) {
+		return 4;
+	}
+	reply->from = getpid();
+	strcpy(reply->text, "pong");
+	kmem_cache_free(messages, received);
+	if (write(to_parent, &reply, sizeof(reply)) != sizeof(reply)) {
+		return 5;
+	}
+	kmem_release_arena();
+	return 0;
+}
+
+int main() {
+
+	char name[64];
+	snprintf(name, sizeof(name), "/kmem_shared_test_%d", (int)getpid());
+	assert(kmem_shared_attach(name));
+
+	// The child forks before the arena exists, so the range it maps at is free in the child as well
+	int to_child[2], to_parent[2];
+	assert(!pipe(to_child) && !pipe(to_parent));
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (!pid) {
+		close(to_child[1]);
+		close(to_parent[0]);
+		_exit(child(name, to_child[0], to_parent[1]));
+	}
+	// Either side failing closes its ends, so the other one sees end of file instead of waiting forever
+	close(to_child[0]);
+	close(to_parent[1]);
+
+	assert(!kmem_shared_create(name, BLOCK_NUMBER));
+	// A ctor means nothing in the other process
+	assert(!kmem_cache_create("shared_test ctor", sizeof(Message), construct, NULL));
+	kmem_cache_t* messages = kmem_cache_create("shared_test messages", sizeof(Message), NULL, NULL);
+	assert(kmem_cache_find("shared_test messages") == messages);
+
+	Message* sent = (Message*)kmem_cache_alloc(messages);
+	sent->from = getpid();
+	strcpy(sent->text, "ping");
+	assert(write(to_child[1], &sent, sizeof(sent)) == sizeof(sent));
+
+	Message* reply;
+	assert(read(to_parent[0], &reply, sizeof(reply)) == sizeof(reply));
+	assert(reply->from == pid && !strcmp(reply->text, "pong"));
+	kmem_cache_free(messages, reply);
+
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	// Every allocation and free of both processes went to the same counters
+	kmem_cache_stats_t stats;
+	kmem_cache_get_stats(messages, &stats);
+	assert(stats.allocs == 2 && stats.frees == 2);
+
+	kmem_cache_destroy(messages);
+	assert(!kmem_shared_unlink(name));
+	kmem_release_arena();
+
+	printf("shared arena checks passed\n");
+	return 0;
+}
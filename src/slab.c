@@ -1,26 +1,92 @@
-#pragma once
-
 #include "buddy.h"
+#include "lock.h"
+#include "profile.h"
+#include "size_classes.h"
 #include "slab.h"
 #include "utils.h"
 #include <math.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <Windows.h>
+#include <string.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BITVECTOR_SIMD_SCAN 1
+#else
+#define BITVECTOR_SIMD_SCAN 0
+#endif
 
 #define _CRT_SECURE_NO_WARNINGS
 #define L1_CACHE_ALIGNMENT 1
+#define THREAD_CACHE_NUMBER 64
+#define MAGAZINE_MAX_SIZE 64
+#define MAGAZINE_DEFAULT_SIZE 32
+#define DEPOT_FULL_PER_SLOT 4		// full magazines a depot keeps per thread slot in use
+#define SIMD_SCAN_MIN_WORDS 8
+#define SIZE_CLASS_MIN_OBJECTS 16
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_MAX_ORDER 6
+#define OFF_SLAB_MIN_OBJECT_SIZE (BLOCK_SIZE / 8)	// from this size on the slab holds nothing but objects
+#define SLAB_MANAGEMENT_WORDS 16			// bitvector capacity of an off-slab descriptor
+#define SLAB_WASTE_DIVISOR 32	// a slab order is good enough once it wastes at most 1/32 of the slab
+#define MERGE_ALIGNMENT (sizeof(void*))	// mergeable sizes are rounded up to this before looking for a shared cache
+#define ALIAS_COUNTER_SLOTS 8		// thread slots with counters of their own in an alias, the others share them
+#define NATURAL_ALIGNMENT_MAX (2 * sizeof(void*))	// objects are aligned to the largest power of two dividing their size, up to this
+#define REAPER_DEFAULT_WARM_SLABS 1
+#define REAPER_DEFAULT_IDLE_MS 1000
+#define REAPER_BATCH_SLABS 8		// slabs released per cache lock hold
+#define SHARED_ARENA_MAGIC 0x4b4d454du	// "KMEM"
+#define REAPER_TICK_MS 10		// resolution of the reaper clock
+#define RECLAIM_STAGES 3		// empty slabs, then magazines, then client shrinkers
+#define RECLAIM_MAX_CANDIDATES 64	// caches ranked per round of empty slab reclaim
+#define MAX_SHRINKERS 32
 
 void get_slab(kmem_cache_t* cachep);
-void kmem_init(void* space, int block_num);
-kmem_cache_t* kmem_cache_create(const char* name, size_t size, void (*ctor)(void*), void (*dtor)(void*)); // Allocate cache
+void deferred_free_push(kmem_cache_t* cachep, void** objects, int count);
+void deferred_free_drain_locked(kmem_cache_t* cachep);
+void* magazine_layer_alloc(kmem_cache_t* cachep, int magazine_size);
+void magazine_layer_free(kmem_cache_t* cachep, void* objp, int magazine_size);
+// The allocator's own metadata goes through these, the public entry points add profiling on top
+void* cache_alloc_reclaim(kmem_cache_t* cachep);
+void cache_free(kmem_cache_t* cachep, void* objp);
+void kmem_init(void* space, size_t block_num);
+void kmem_init_aligned(void* space, size_t block_num, size_t alignment);
+int kmem_init_arena(size_t block_num, unsigned flags, int release_order); // Map the arena from the OS and kmem_init it, 0 on success or -1
+void kmem_release_arena(); // Unmap the arena of kmem_init_arena or kmem_shared_*, once the reaper is stopped and nothing uses it. The allocator is uninitialized afterwards.
+#ifdef KMEM_SHARED_ARENA
+int kmem_shared_create(const char* name, size_t block_num); // Create a named shared memory arena other processes can attach, 0 on success or -1
+int kmem_shared_attach(const char* name); // Attach the shared arena another process created, 0 on success or -1
+int kmem_shared_unlink(const char* name); // Remove the name, the memory goes away once every process released the arena
+#endif
+kmem_cache_t* kmem_cache_find(const char* name); // First cache created with this name, NULL if there is none
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, void (*ctor)(void*), void (*dtor)(void*)); // Allocate cache, ctor runs once per object when its slab is created, dtor when the slab is released
+kmem_cache_t* kmem_cache_create_flags(const char* name, size_t size, void (*ctor)(void*), void (*dtor)(void*), unsigned flags); // Same, caches without ctor and dtor are aliases of a shared cache of their size unless KMEM_CACHE_NO_MERGE is set
+kmem_cache_t* kmem_cache_create_aligned(const char* name, size_t size, size_t align, void (*ctor)(void*), void (*dtor)(void*), unsigned flags); // Same, objects start at multiples of align, a power of two up to BLOCK_SIZE (0 for natural alignment)
 int kmem_cache_shrink(kmem_cache_t* cachep); // Shrink cache
 void* kmem_cache_alloc(kmem_cache_t* cachep); // Allocate one object from cache
 void kmem_cache_free(kmem_cache_t* cachep, void* objp); // Deallocate one object from cache
-void* kmalloc(size_t size); // Alloacate one small memory buffer
-void kfree(const void* objp); // Deallocate one small memory buffer
+int kmem_cache_alloc_bulk(kmem_cache_t* cachep, void** objects, int count); // Allocate up to count objects, returns how many were allocated
+void kmem_cache_free_bulk(kmem_cache_t* cachep, void** objects, int count); // Deallocate count objects from cache
+void* kmalloc(size_t size); // Alloacate one memory buffer, large ones come straight from the buddy allocator. Aligned to the largest power of two dividing its size class up to twice the pointer size, large ones to a block
+void kfree(const void* objp); // Deallocate one memory buffer
 void kmem_cache_destroy(kmem_cache_t* cachep); // Deallocate cache
 void kmem_cache_info(kmem_cache_t* cachep); // Print cache info
 int kmem_cache_error(kmem_cache_t* cachep); // Print error message
+int kmem_cache_set_magazine_size(kmem_cache_t* cachep, int size); // Tune per-thread magazine depth (0 disables), right after creating the cache and before it is used
+void kmem_cache_get_stats(kmem_cache_t* cachep, kmem_cache_stats_t* stats); // Read the counters of one cache without stopping it
+int kmem_stats_snapshot(kmem_cache_stats_t* stats, int max_caches); // Fill up to max_caches entries, returns the number of caches
+int kmem_stats_json(char* buffer, size_t size); // Every cache and buddy order as JSON, returns the length like snprintf
+size_t kmem_reap(); // Flush depot magazines and release empty slabs idle past the reap policy of every cache once, returns the number of blocks given back
+int kmem_reaper_start(int interval_ms); // Run kmem_reap every interval_ms on a background thread, -1 if it is already running
+unsigned long long kmem_reaper_stop(); // Stop the reaper before the arena goes away, returns the blocks reclaimed so far
+unsigned long long kmem_reaped_blocks(); // Blocks reclaimed by kmem_reap and the reaper so far
+void kmem_cache_set_reap_policy(kmem_cache_t* cachep, int warm_slabs, int idle_ms); // Keep warm_slabs empty slabs, reap the rest once idle for idle_ms (defaults 1 and 1000)
+int kmem_register_shrinker(kmem_shrinker_t shrink, void* data); // Called when memory runs out, 0 on success or -1 if MAX_SHRINKERS are registered or the arena is shared
+void kmem_unregister_shrinker(kmem_shrinker_t shrink, void* data); // Not from inside a shrinker
+void kmem_profile_start(size_t sample_bytes); // Sample one allocation per sample_bytes allocated on average (0 for 512 KiB), drops earlier samples
+void kmem_profile_stop(); // Stop sampling, the samples are kept and still follow frees
+int kmem_profile_dump(const char* path); // Write the live and allocated samples as a pprof heap profile, 0 on success or -1
 
 typedef enum error_code {
 	OK,
@@ -29,616 +95,1780 @@ typedef enum error_code {
 	CACHE_CANNOT_BE_DELETED
 } error_code;
 
+typedef enum slab_list {
+	NO_SLABS,
+	FULL_SLABS,
+	MIXED_SLABS,
+	EMPTY_SLABS
+} slab_list;
+
 typedef struct slab {
 	struct slab* next;
+	struct slab* prev;
+	slab_list list;
 	kmem_cache_t* my_cache;
 	void* starting_slot;
 	unsigned* bitvector_start;
 	int free_slot_cnt;
-	char dummy[4];
+	int free_word_hint;	// every bitvector word before this one is full
+	int colour_offset;	// bytes between the start of the objects area and starting_slot
+	unsigned empty_since;	// reaper clock when the slab went on the empty list
 } SlabMetaData;
 
+// One entry per buddy block, so an object is mapped to its slab without walking any slab list
+typedef struct page_descriptor {
+	SlabMetaData* slab;
+	kmem_cache_t* cache;
+	unsigned char large;	// first block of a large kmalloc buffer
+	unsigned char order;	// the large buffer spans 2^order blocks
+} PageDescriptor;
+
+typedef struct magazine {
+	struct magazine* next;
+	int rounds;
+	void* objects[MAGAZINE_MAX_SIZE];
+} Magazine;
+
+typedef struct thread_cache {
+	SpinLock lock;
+	Magazine* loaded;
+	Magazine* previous;
+	volatile unsigned long long allocs;	// statistics of the threads in this slot, kept here so they share no counter
+	volatile unsigned long long frees;
+	volatile unsigned long long failures;
+} ThreadCache;
+
+typedef struct depot {
+	Magazine* full_magazines;
+	Magazine* empty_magazines;
+	int full_cnt;
+	int empty_cnt;
+	int full_min;		// working set: fewest magazines held since window_start, those at the bottom were never touched
+	int empty_min;
+	unsigned window_start;	// ms
+	SpinLock lock;
+} Depot;
+
 typedef struct kmem_cache_s {
 	char name[30];
 	struct kmem_cache_s* next;
 
 	int num_of_objects_in_slab;
-	int object_size_in_bytes;
+	int object_size_in_bytes;	// a multiple of align
+	int align;			// every object starts at a multiple of it
 	int slab_size_in_blocks;
 	int bitvector_size_in_unsigned;
 
 	int unused_space_in_bytes;
+	int off_slab;		// SlabMetaData and the bitvector come from slab_management_cache instead of the slab itself
 
 	SlabMetaData* empty_slabs;
 	SlabMetaData* mixed_slabs;
 	SlabMetaData* full_slabs;
 
-	HANDLE mutex;
+	SlabMetaData* empty_slabs_tail;	// empty slabs are added at the head, so the tail has been idle the longest
+	int empty_slab_count;
+	int reap_warm_slabs;		// empty slabs the reaper leaves alone
+	int reap_idle_ms;		// the reaper releases empty slabs idle for longer than this
+
+	Mutex mutex;
 	error_code err;
 
 	void(*ctor)(void*);
 	void(*dtor)(void*);
+
+	void* volatile deferred_frees;	// objects freed while the cache lock was taken, linked through their first word
+
+	struct kmem_cache_s* backing;	// alias handles forward every operation to this shared cache
+	int merge_refcount;		// shared caches: number of alias handles attached, guarded by main_mutex
+
+	volatile unsigned long long slab_grows;		// written under the cache mutex, read without it
+	volatile unsigned long long slab_shrinks;
+
+	int magazine_size;
+	Depot depot;
+	ThreadCache thread_caches[THREAD_CACHE_NUMBER];	// an alias only has the first ALIAS_COUNTER_SLOTS
 } kmem_cache_s;
 
+// Aliases forward everything to their shared cache and only keep counters, so their descriptor ends early
+#define ALIAS_DESCRIPTOR_SIZE (offsetof(kmem_cache_s, thread_caches) + ALIAS_COUNTER_SLOTS * sizeof(ThreadCache))
+
+typedef struct shrinker {
+	kmem_shrinker_t shrink;
+	void* data;
+} Shrinker;
+
 typedef struct SlabManager {
 	kmem_cache_t cache_of_caches;
-	kmem_cache_t small_buffer_caches[NUMBER_OF_BUFFER_DEGREES];
+	kmem_cache_t small_buffer_caches[NUMBER_OF_SIZE_CLASSES];
+	kmem_cache_t magazine_cache;
+	kmem_cache_t slab_management_cache;
+	kmem_cache_t alias_cache;
+
+	Mutex print_mutex;
+
+	Mutex main_mutex;
 
-	HANDLE slab_mutex;
-	HANDLE print_mutex;
-	HANDLE free_mutex;
-	HANDLE list_mutex;
-	HANDLE allocation_mutex;
+	PageDescriptor* page_descriptors;
 
-	HANDLE main_mutex;
+	Thread reaper;
+	volatile int reaper_running;
+	int reaper_interval_ms;
+	volatile int reaper_clock;		// ms, advanced by the reaper thread so stamping a slab costs no clock read while it runs
+	volatile unsigned long long reaped_blocks;
+
+	Mutex shrinker_mutex;		// held while the shrinkers run, so they never run concurrently
+	Shrinker shrinkers[MAX_SHRINKERS];
+	int shrinker_count;
+	volatile unsigned long long pressure_reclaimed_blocks;
+
+	void* arena;			// mapping made by kmem_init_arena, NULL for an arena the caller passed to kmem_init
+	size_t arena_bytes;
+	int shared;			// other processes may use the arena, so it must hold no function pointers
 
 } SlabManager;
 
 static BuddyManager* buddy_manager;
 static SlabManager* slab_manager;
 
+int get_free_index_bitvector(kmem_cache_t* cachep, SlabMetaData* slab);
+int reclaim_memory(int stage, size_t blocks_wanted);
+
+// Set while this thread runs reclaim or a ctor/dtor, code that may hold allocator locks
+static THREAD_LOCAL int reclaim_disabled = 0;
+void cache_account(kmem_cache_t* cachep, int allocs, int frees, int failures);
+
 
 // -------------------------------------------------------------------------------------------------------------------------------
 
 
-void initialize_cache_of_caches() {
+void initialize_magazine_layer(kmem_cache_t* cachep, int magazine_size) {
 
-	kmem_cache_t* cache_of_caches = &slab_manager->cache_of_caches;
-	cache_of_caches->next = NULL;
-	strcpy(cache_of_caches->name, cache_of_caches_name);
-	cache_of_caches->object_size_in_bytes = sizeof(kmem_cache_t);
+	cachep->magazine_size = magazine_size;
 
-	int slab_size_in_blocks = 1;
-	while (slab_size_in_blocks * BLOCK_SIZE / sizeof(kmem_cache_t) < 64) {
-		slab_size_in_blocks++;
-	}
+	cachep->depot.full_magazines = cachep->depot.empty_magazines = NULL;
+	cachep->depot.full_cnt = cachep->depot.empty_cnt = 0;
+	cachep->depot.full_min = cachep->depot.empty_min = 0;
+	cachep->depot.window_start = monotonic_time_ms();
+	spin_lock_init(&cachep->depot.lock);
+
+	memset(cachep->thread_caches, 0, sizeof(cachep->thread_caches));
+}
 
-	cache_of_caches->slab_size_in_blocks = next_power_of_two(slab_size_in_blocks);
+int default_magazine_size(kmem_cache_t* cachep) {
 
-	cache_of_caches->bitvector_size_in_unsigned = 
-		((cache_of_caches->slab_size_in_blocks * BLOCK_SIZE - sizeof(SlabMetaData) - 2) / (sizeof(kmem_cache_t) + 1)) / bits_in_unsigned;
+	// Keep at most half a slab in every magazine, so a thread cannot pin whole slabs of a cache with few objects per slab
+	int magazine_size = cachep->num_of_objects_in_slab / 2;
+	if (magazine_size > MAGAZINE_DEFAULT_SIZE) {
+		magazine_size = MAGAZINE_DEFAULT_SIZE;
+	}
+	if (magazine_size < 0) {
+		magazine_size = 0;
+	}
+	return magazine_size;
+}
 
-	cache_of_caches->num_of_objects_in_slab = cache_of_caches->bitvector_size_in_unsigned * bits_in_unsigned - 1;
+int natural_alignment(size_t size) {
+	size_t align = size & (~size + 1);
+	return (int)(!align || align > NATURAL_ALIGNMENT_MAX ? NATURAL_ALIGNMENT_MAX : align);
+}
 
-	cache_of_caches->ctor = cache_of_caches->dtor = NULL;
-	cache_of_caches->empty_slabs = cache_of_caches->full_slabs = cache_of_caches->mixed_slabs = NULL;
-	cache_of_caches->mutex = CreateMutex(NULL, FALSE, NULL);
+// align 0 picks the natural alignment of size
+void set_object_size(kmem_cache_t* cachep, size_t size, size_t align) {
+	cachep->align = align ? (int)align : natural_alignment(size);
+	cachep->object_size_in_bytes = (int)((size + cachep->align - 1) & ~(size_t)(cachep->align - 1));
+}
 
-	cache_of_caches->unused_space_in_bytes = 
-		(cache_of_caches->slab_size_in_blocks * BLOCK_SIZE - sizeof(SlabMetaData) - cache_of_caches->bitvector_size_in_unsigned * sizeof(unsigned)) % sizeof(kmem_cache_t);
+// Slabs are block aligned, so an offset that is a multiple of align keeps the objects aligned
+int objects_offset(kmem_cache_t* cachep, int bitvector_words) {
+	if (cachep->off_slab) {
+		return 0;
+	}
+	int header = (int)sizeof(SlabMetaData) + (bitvector_words + 1) * (int)sizeof(unsigned);
+	return (header + cachep->align - 1) & ~(cachep->align - 1);
 }
 
-void initialize_small_buffer_caches() {
+// Slab layout: [SlabMetaData][bitvector][one spare word][alignment padding][colouring offset][objects], sized for as
+// many objects as fit. Off-slab caches keep only [colouring offset][objects] in the slab.
+void set_slab_layout(kmem_cache_t* cachep, int slab_size_in_blocks) {
+
+	int object_size = cachep->object_size_in_bytes;
+	int slab_bytes = slab_size_in_blocks * BLOCK_SIZE;
+	int available = slab_bytes;
+	int bitvector_in_slab = !cachep->off_slab;
+	if (bitvector_in_slab) {
+		available -= (int)sizeof(SlabMetaData) + (int)sizeof(unsigned);
+	}
 
-	kmem_cache_t* small_buffer_caches = &slab_manager->small_buffer_caches;
-	for (int i = STARTING_BUFFER_DEGREE; i <= NUMBER_OF_BUFFER_DEGREES + STARTING_BUFFER_DEGREE; i++) {
+	// Every object costs its size plus one bit, round the bitvector up to whole words afterwards
+	int objects = (int)((long long)available * 8 / ((long long)object_size * 8 + bitvector_in_slab));
+	int words = (objects + bits_in_unsigned - 1) / bits_in_unsigned;
+	while (objects > 0 && objects_offset(cachep, words) + objects * object_size > slab_bytes) {
+		objects--;
+		words = (objects + bits_in_unsigned - 1) / bits_in_unsigned;
+	}
+	if (!bitvector_in_slab) {
+		words = 0;
+	}
 
-		kmem_cache_t* current_cache = small_buffer_caches + (i - STARTING_BUFFER_DEGREE);
-		current_cache->next = NULL;
-		strcpy(current_cache->name, small_buffer_cache_name);
-		current_cache->object_size_in_bytes = pow(2, i);
+	cachep->slab_size_in_blocks = slab_size_in_blocks;
+	cachep->num_of_objects_in_slab = objects;
+	cachep->unused_space_in_bytes = slab_bytes - objects_offset(cachep, words) - objects * object_size;
+	cachep->bitvector_size_in_unsigned = (objects + bits_in_unsigned - 1) / bits_in_unsigned;
+}
 
-		int slab_size_in_blocks = 1;
-		while (slab_size_in_blocks * BLOCK_SIZE / current_cache->object_size_in_bytes < 64) {
-			slab_size_in_blocks++;
+// Picks the smallest slab order holding at least min_objects that wastes at most 1/SLAB_WASTE_DIVISOR of the slab,
+// or the one wasting the smallest fraction if none does, so small classes do not end up with huge slabs.
+// Objects too big for min_objects within max_order settle for fewer objects in one of the two orders above the
+// smallest one that holds an object at all.
+void set_best_slab_layout(kmem_cache_t* cachep, int min_objects, int max_order) {
+
+	int best_blocks = 0;
+	long long best_unused = 0;
+	for (int order = 0; order <= max_order; order++) {
+		set_slab_layout(cachep, 1 << order);
+		if (cachep->num_of_objects_in_slab < min_objects) {
+			continue;
 		}
-		current_cache->slab_size_in_blocks = next_power_of_two(slab_size_in_blocks);
+		if ((long long)cachep->unused_space_in_bytes * SLAB_WASTE_DIVISOR <= (long long)BLOCK_SIZE << order) {
+			return;
+		}
+		// unused / blocks < best_unused / best_blocks
+		if (!best_blocks || (long long)cachep->unused_space_in_bytes * best_blocks < best_unused * (1 << order)) {
+			best_blocks = 1 << order;
+			best_unused = cachep->unused_space_in_bytes;
+		}
+	}
+	if (best_blocks) {
+		set_slab_layout(cachep, best_blocks);
+		return;
+	}
 
-		current_cache->bitvector_size_in_unsigned = 
-			((current_cache->slab_size_in_blocks * BLOCK_SIZE - sizeof(SlabMetaData) - 2) / (current_cache->object_size_in_bytes + 1)) / bits_in_unsigned;
+	if (min_objects > 1) {
+		int order = 0;
+		do {
+			set_slab_layout(cachep, 1 << order);
+		} while (!cachep->num_of_objects_in_slab && ++order < 30);
 
-		current_cache->num_of_objects_in_slab =
-			((current_cache->slab_size_in_blocks * BLOCK_SIZE - sizeof(SlabMetaData) - sizeof(unsigned) * current_cache->bitvector_size_in_unsigned) / current_cache->object_size_in_bytes);
-		current_cache->num_of_objects_in_slab = current_cache->bitvector_size_in_unsigned * bits_in_unsigned - 1;
+		int limit = order + 2 < buddy_manager->largest_block_degree2 ? order + 2 : buddy_manager->largest_block_degree2;
+		set_best_slab_layout(cachep, 1, limit > order ? limit : order);
+		return;
+	}
+	set_slab_layout(cachep, 1 << max_order);
+}
 
+// Large objects go off-slab, unless a slab would hold more objects than an off-slab descriptor can track
+void set_cache_layout(kmem_cache_t* cachep, int min_objects) {
 
-		current_cache->ctor = current_cache->dtor = NULL;
-		current_cache->empty_slabs = current_cache->full_slabs = current_cache->mixed_slabs = NULL;
-		current_cache->mutex = CreateMutex(NULL, FALSE, NULL);
+	cachep->off_slab = cachep->object_size_in_bytes >= OFF_SLAB_MIN_OBJECT_SIZE;
+	set_best_slab_layout(cachep, min_objects, SLAB_MAX_ORDER);
 
-		current_cache->unused_space_in_bytes =
-			(current_cache->slab_size_in_blocks * BLOCK_SIZE - sizeof(SlabMetaData) - current_cache->bitvector_size_in_unsigned * sizeof(unsigned)) % current_cache->object_size_in_bytes;
+	if (cachep->off_slab && cachep->bitvector_size_in_unsigned > SLAB_MANAGEMENT_WORDS) {
+		cachep->off_slab = 0;
+		set_best_slab_layout(cachep, min_objects, SLAB_MAX_ORDER);
 	}
 }
 
-void kmem_init(void* space, int block_num) {
-	init_buddy_manager(space, block_num);
-	buddy_manager = get_buddy_manager();
+// Every cache goes through here, internal ones re-do the layout and the magazine depth afterwards
+void initialize_cache(kmem_cache_t* cachep, const char* name, size_t size, size_t align, void(*ctor)(void*), void(*dtor)(void*)) {
+
+	strcpy(cachep->name, name);
+	cachep->empty_slabs = cachep->full_slabs = cachep->mixed_slabs = NULL;
+	cachep->ctor = ctor;
+	cachep->dtor = dtor;
+	cachep->next = NULL;
+
+	set_object_size(cachep, size, align);
+	set_cache_layout(cachep, SLAB_MIN_OBJECTS);
+
+	mutex_init(&cachep->mutex);
+	cachep->deferred_frees = NULL;
+	cachep->backing = NULL;
+	cachep->merge_refcount = 0;
+	cachep->slab_grows = cachep->slab_shrinks = 0;
+	cachep->empty_slabs_tail = NULL;
+	cachep->empty_slab_count = 0;
+	cachep->reap_warm_slabs = REAPER_DEFAULT_WARM_SLABS;
+	cachep->reap_idle_ms = REAPER_DEFAULT_IDLE_MS;
+	cachep->err = OK;
+
+	initialize_magazine_layer(cachep, default_magazine_size(cachep));
+}
 
-	BuddyManager* slab_manager_adr = buddy_manager + 1;
-	slab_manager = (SlabManager*)slab_manager_adr;
+void initialize_magazine_cache() {
 
-	slab_manager->slab_mutex = CreateMutex(NULL, FALSE, NULL);
-	slab_manager->print_mutex = CreateMutex(NULL, FALSE, NULL);
-	slab_manager->free_mutex = CreateMutex(NULL, FALSE, NULL);
-	slab_manager->list_mutex = CreateMutex(NULL, FALSE, NULL);
-	slab_manager->allocation_mutex = CreateMutex(NULL, FALSE, NULL);
-	slab_manager->main_mutex = CreateMutex(NULL, FALSE, NULL);
+	kmem_cache_t* magazine_cache = &slab_manager->magazine_cache;
+	initialize_cache(magazine_cache, magazine_cache_name, sizeof(Magazine), 0, NULL, NULL);
 
-	initialize_cache_of_caches();
-	initialize_small_buffer_caches();
+	int slab_size_in_blocks = 1;
+	while (slab_size_in_blocks * BLOCK_SIZE / sizeof(Magazine) < 64) {
+		slab_size_in_blocks++;
+	}
+
+	magazine_cache->off_slab = 0;
+	set_slab_layout(magazine_cache, next_power_of_two(slab_size_in_blocks));
+
+	// Magazines are allocated on the magazine layer slow path, so this cache must never use magazines itself
+	initialize_magazine_layer(magazine_cache, 0);
 }
 
-kmem_cache_t* kmem_cache_create(const char* name, size_t size, void(*ctor)(void*), void(*dtor)(void*)) {
+// Holds SlabMetaData and the bitvector of off-slab slabs, it is on-slab itself so get_slab never recurses
+void initialize_slab_management_cache() {
 
-	WaitForSingleObject(slab_manager->main_mutex, INFINITE);
+	kmem_cache_t* management_cache = &slab_manager->slab_management_cache;
+	initialize_cache(management_cache, slab_management_cache_name, sizeof(SlabMetaData) + SLAB_MANAGEMENT_WORDS * sizeof(unsigned), 0, NULL, NULL);
 
-	kmem_cache_t* created_cache = (kmem_cache_t*)kmem_cache_alloc(&(slab_manager->cache_of_caches));
+	management_cache->off_slab = 0;
+	set_best_slab_layout(management_cache, SIZE_CLASS_MIN_OBJECTS, SLAB_MAX_ORDER);
 
-	strcpy(created_cache->name, name);
-	created_cache->empty_slabs = created_cache->full_slabs = created_cache->mixed_slabs = NULL;
-	created_cache->ctor = ctor;
-	created_cache->dtor = dtor;
-	created_cache->next = NULL;
+	initialize_magazine_layer(management_cache, 0);
+}
 
-	kmem_cache_t* iterator = &slab_manager->cache_of_caches, * prev = NULL;
-	while (iterator) {
-		prev = iterator;
-		iterator = iterator->next;
-	}
-	if (prev) {
-		prev->next = created_cache;
-	}
+void initialize_alias_cache() {
+
+	kmem_cache_t* alias_cache = &slab_manager->alias_cache;
+	initialize_cache(alias_cache, alias_cache_name, ALIAS_DESCRIPTOR_SIZE, 0, NULL, NULL);
+
+	alias_cache->off_slab = 0;
+	set_best_slab_layout(alias_cache, SIZE_CLASS_MIN_OBJECTS, SLAB_MAX_ORDER);
+
+	initialize_magazine_layer(alias_cache, 0);
+}
+
+void initialize_cache_of_caches() {
+
+	kmem_cache_t* cache_of_caches = &slab_manager->cache_of_caches;
+	initialize_cache(cache_of_caches, cache_of_caches_name, sizeof(kmem_cache_t), 0, NULL, NULL);
 
-	created_cache->object_size_in_bytes = size;
 	int slab_size_in_blocks = 1;
-	while (slab_size_in_blocks * BLOCK_SIZE / size < 32) {
+	while (slab_size_in_blocks * BLOCK_SIZE / sizeof(kmem_cache_t) < 64) {
 		slab_size_in_blocks++;
 	}
 
-	created_cache->slab_size_in_blocks = next_power_of_two(slab_size_in_blocks);
+	cache_of_caches->off_slab = 0;
+	set_slab_layout(cache_of_caches, next_power_of_two(slab_size_in_blocks));
 
-	created_cache->bitvector_size_in_unsigned = 
-		(created_cache->slab_size_in_blocks * BLOCK_SIZE - sizeof(SlabMetaData) - 2) / (created_cache->object_size_in_bytes + 1) / bits_in_unsigned;
+	initialize_magazine_layer(cache_of_caches, 0);
+}
 
-	created_cache->num_of_objects_in_slab =
-		(created_cache->slab_size_in_blocks * BLOCK_SIZE - sizeof(SlabMetaData) - sizeof(unsigned) * created_cache->bitvector_size_in_unsigned) / created_cache->object_size_in_bytes;
-	created_cache->num_of_objects_in_slab = created_cache->bitvector_size_in_unsigned * bits_in_unsigned - 1;
+void initialize_small_buffer_caches() {
 
-	created_cache->unused_space_in_bytes =
-		(created_cache->slab_size_in_blocks * BLOCK_SIZE - sizeof(SlabMetaData) - created_cache->bitvector_size_in_unsigned * sizeof(unsigned)) % created_cache->object_size_in_bytes;
+	for (int i = 0; i < NUMBER_OF_SIZE_CLASSES; i++) {
 
-	created_cache->mutex = CreateMutex(NULL, FALSE, NULL);
+		kmem_cache_t* current_cache = &slab_manager->small_buffer_caches[i];
+		initialize_cache(current_cache, small_buffer_cache_name, size_class_sizes[i], 0, NULL, NULL);
 
-	ReleaseMutex(slab_manager->main_mutex);
-	return created_cache;
+		set_cache_layout(current_cache, SIZE_CLASS_MIN_OBJECTS);
+		initialize_magazine_layer(current_cache, default_magazine_size(current_cache));
+	}
 }
 
-void* kmem_cache_alloc(kmem_cache_t* cachep) {
+// The arena is trimmed to start on a block boundary, so slabs and large buffers are block aligned in memory.
+// Buddy runs of alignment bytes and more are aligned to it as well.
+void kmem_init_aligned(void* space, size_t block_num, size_t alignment) {
+	size_t misalignment = (size_t)space % BLOCK_SIZE;
+	if (misalignment) {
+		space = (char*)space + BLOCK_SIZE - misalignment;
+		block_num--;
+	}
+	init_buddy_manager(space, block_num, sizeof(SlabManager) + block_num * sizeof(PageDescriptor), 0, alignment);
+	buddy_manager = get_buddy_manager();
 
-	WaitForSingleObject(slab_manager->allocation_mutex, INFINITE);
-	WaitForSingleObject(cachep->mutex, INFINITE);
+	BuddyManager* slab_manager_adr = buddy_manager + 1;
+	slab_manager = (SlabManager*)slab_manager_adr;
 
-	if (!cachep->empty_slabs && !cachep->mixed_slabs) {
-		get_slab(cachep);
-	}
+	mutex_init(&slab_manager->print_mutex);
+	mutex_init(&slab_manager->main_mutex);
 
-	SlabMetaData* slab = NULL;
+	slab_manager->reaper_running = 0;
+	slab_manager->reaper_interval_ms = 0;
+	slab_manager->reaper_clock = (int)monotonic_time_ms();
+	slab_manager->reaped_blocks = 0;
 
-	if (cachep->mixed_slabs) {
-		slab = cachep->mixed_slabs;
-		cachep->mixed_slabs = slab->next;
-		slab->next = NULL;
-	}
-	else if (cachep->empty_slabs) {
-		slab = cachep->empty_slabs;
-		cachep->empty_slabs = slab->next;
-		slab->next = NULL;
-	}
-	else {
-		printf("\n\nSLAB_SLOT_ALLOCATION_ERROR\n\n");
-		cachep->err = SLAB_SLOT_ALLOCATION_ERROR;
-		ReleaseMutex(cachep->mutex);
-		ReleaseMutex(slab_manager->allocation_mutex);
-		return NULL;
-	}
+	mutex_init(&slab_manager->shrinker_mutex);
+	slab_manager->shrinker_count = 0;
+	slab_manager->pressure_reclaimed_blocks = 0;
 
-	int free_index = get_free_index_bitvector(cachep, slab);
-	if (free_index == -1) {
-		printf("\n\nSLAB_SLOT_ALLOCATION_ERROR\n\n");
-		cachep->err = SLAB_SLOT_ALLOCATION_ERROR;
-		ReleaseMutex(cachep->mutex);
-		ReleaseMutex(slab_manager->allocation_mutex);
-		return NULL;
-	}
+	slab_manager->arena = NULL;
+	slab_manager->arena_bytes = 0;
+	slab_manager->shared = 0;
 
-	int index = free_index / bits_in_unsigned;
-	int deg = free_index % bits_in_unsigned;
-	unsigned mask = 1 << deg;
-	slab->bitvector_start[index] |= mask;
+	slab_manager->page_descriptors = (PageDescriptor*)(slab_manager + 1);
+	memset(slab_manager->page_descriptors, 0, buddy_manager->number_of_blocks * sizeof(PageDescriptor));
+
+	initialize_magazine_cache();
+	initialize_slab_management_cache();
+	initialize_cache_of_caches();
+	initialize_alias_cache();
+	initialize_small_buffer_caches();
+}
 
-	slab->free_slot_cnt--;
+void kmem_init(void* space, size_t block_num) {
+	kmem_init_aligned(space, block_num, BLOCK_SIZE);
+}
 
-	if (!slab->free_slot_cnt) {
-		slab->next = cachep->full_slabs;
-		cachep->full_slabs = slab;
+// The manager area at the start of the arena is touched by kmem_init and stays resident, the blocks only fault in
+// once they are allocated and with a release order go back to the OS once they coalesce into large free runs
+int kmem_init_arena(size_t block_num, unsigned flags, int release_order) {
+
+	size_t bytes = block_num * BLOCK_SIZE;
+	int huge = (flags & KMEM_ARENA_HUGE_PAGES) != 0;
+	void* space = vm_reserve(&bytes, &huge);
+	if (!space) {
+		printf("\nCannot map a %zu block arena!\n", block_num);
+		return -1;
 	}
-	else {
-		slab->next = cachep->mixed_slabs;
-		cachep->mixed_slabs = slab;
+
+	// Runs of a huge page are whole huge pages, so releasing them never splits one
+	kmem_init_aligned(space, bytes / BLOCK_SIZE, (flags & KMEM_ARENA_HUGE_PAGES) ? VM_HUGE_PAGE_SIZE : BLOCK_SIZE);
+	slab_manager->arena = space;
+	slab_manager->arena_bytes = bytes;
+	if (release_order >= 0) {
+		// Explicit huge pages can only be dropped whole, transparent ones would be split
+		size_t granule = (flags & KMEM_ARENA_HUGE_PAGES) ? VM_HUGE_PAGE_SIZE : vm_page_size();
+		buddy_set_release(release_order, granule, (flags & KMEM_ARENA_LAZY_RELEASE) != 0);
 	}
+	return 0;
+}
 
-	void* obj = (void*)((unsigned)slab->starting_slot + free_index * cachep->object_size_in_bytes);
-	if (cachep->ctor) {
-		cachep->ctor(obj);
+// The manager lives in the arena, so this reads the mapping out of it right before it is gone
+void kmem_release_arena() {
+	if (!slab_manager || !slab_manager->arena) {
+		return;
 	}
+	vm_release(slab_manager->arena, slab_manager->arena_bytes);
 
-	ReleaseMutex(cachep->mutex);
-	ReleaseMutex(slab_manager->allocation_mutex);
-	return obj;
+	// Nothing may point into the unmapped arena, a later kmem_init starts from scratch and a second release is a no-op
+	slab_manager = NULL;
+	buddy_manager = NULL;
+	attach_buddy_manager(NULL);
 }
 
-void get_slab(kmem_cache_t* cachep) {
+#ifdef KMEM_SHARED_ARENA
+// First block of a shared arena, the allocator follows it. Fixed-address mode: every process maps the object at the
+// address the creating one got, so the pointers inside the arena mean the same thing in all of them. The allocator
+// keeps plain pointers in its lists and hands them to clients, offsets from the arena base would have to be translated
+// in every list operation and at every call.
+typedef struct shared_arena_header {
+	unsigned magic;
+	volatile int ready;		// set once the creating process is done with kmem_init
+	void* address;
+	size_t bytes;
+	size_t buddy_manager_size;	// attaching with a build that lays the managers out differently is refused
+	size_t slab_manager_size;
+} SharedArenaHeader;
+
+// Somewhere in [2^45, 2^45 + 2^44) picked by the name, a range 64-bit processes normally leave alone: their binary,
+// heap and libraries sit far below or far above it. NULL lets the OS choose on smaller address spaces, the attaching
+// processes still have to map the arena where the creating one got it.
+void* shared_arena_address(const char* name) {
+	if (sizeof(void*) < 8) {
+		return NULL;
+	}
+	unsigned long long hash = 1469598103934665603ULL;
+	for (; *name; name++) {
+		hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+	}
+	return (void*)(size_t)((1ULL << 45) + ((hash % 4096) << 32));
+}
 
-	WaitForSingleObject(slab_manager->slab_mutex, INFINITE);
-	WaitForSingleObject(cachep->mutex, INFINITE);
+int kmem_shared_create(const char* name, size_t block_num) {
 
-	Block* block = get_buddy(cachep->slab_size_in_blocks);
-	if (!block) {
-		printf("\n\nBUDDY_ALLOCATION_ERROR\n\n");
-		cachep->err = BUDDY_ALLOCATION_ERROR;
-		ReleaseMutex(cachep->mutex);
-		ReleaseMutex(slab_manager->allocation_mutex);
-		return;
+	size_t bytes = (block_num + 1) * BLOCK_SIZE;
+	int handle = vm_shared_open(name, bytes, 1);
+	if (handle < 0) {
+		printf("\nCannot create shared arena %s!\n", name);
+		return -1;
+	}
+	// Another address would not help, the attaching processes are as likely to have something there
+	void* address = shared_arena_address(name);
+	char* space = (char*)vm_shared_map(handle, bytes, address);
+	vm_shared_close(handle);
+	if (!space) {
+		vm_shared_unlink(name);
+		printf("\nCannot map shared arena %s at %p!\n", name, address);
+		return -1;
 	}
 
-	SlabMetaData* slab = (SlabMetaData*)block;
-	slab->my_cache = cachep;
+	lock_set_process_shared(1);
+	SharedArenaHeader* header = (SharedArenaHeader*)space;
+	header->magic = SHARED_ARENA_MAGIC;
+	header->address = space;
+	header->bytes = bytes;
+	header->buddy_manager_size = sizeof(BuddyManager);
+	header->slab_manager_size = sizeof(SlabManager);
+
+	kmem_init(space + BLOCK_SIZE, block_num);
+	slab_manager->arena = space;
+	slab_manager->arena_bytes = bytes;
+	slab_manager->shared = 1;
+
+	atomic_exchange_int(&header->ready, 1);
+	return 0;
+}
 
-	SlabMetaData* bitvector_start = slab + 1;
-	slab->bitvector_start = (unsigned*)bitvector_start;
-	for (int i = 0; i < cachep->bitvector_size_in_unsigned; i++) {
-		*(slab->bitvector_start + i) = 0;
-	}
+// Fails when the creating process is not done yet, or when the address it mapped the arena at is taken here
+int kmem_shared_attach(const char* name) {
 
-	unsigned* starting_slot = slab->bitvector_start + cachep->bitvector_size_in_unsigned + 1;
+	int handle = vm_shared_open(name, 0, 0);
+	if (handle < 0) {
+		printf("\nCannot open shared arena %s!\n", name);
+		return -1;
+	}
 
-	if (L1_CACHE_ALIGNMENT && (cachep->unused_space_in_bytes / CACHE_L1_LINE_SIZE)) {
-		unsigned cache_offset = rand() % (cachep->unused_space_in_bytes / CACHE_L1_LINE_SIZE);
-		unsigned starting_slot_with_l1_offset = ((unsigned)starting_slot + cache_offset * CACHE_L1_LINE_SIZE);
-		slab->starting_slot = (void*)starting_slot_with_l1_offset;
+	SharedArenaHeader header;
+	memset(&header, 0, sizeof(header));
+	SharedArenaHeader* peek = (SharedArenaHeader*)vm_shared_map(handle, BLOCK_SIZE, NULL);
+	if (peek) {
+		if (atomic_load_acquire_int(&peek->ready)) {
+			memcpy(&header, peek, sizeof(header));
+		}
+		vm_release(peek, BLOCK_SIZE);
 	}
-	else {
-		slab->starting_slot = (void*)starting_slot;
+	if (header.magic != SHARED_ARENA_MAGIC || header.buddy_manager_size != sizeof(BuddyManager)
+		|| header.slab_manager_size != sizeof(SlabManager)) {
+		vm_shared_close(handle);
+		printf("\nShared arena %s is not ready or was made by another build!\n", name);
+		return -1;
 	}
 
-	slab->next = cachep->empty_slabs;
-	cachep->empty_slabs = slab;
-
-	slab->free_slot_cnt = cachep->num_of_objects_in_slab;
+	char* space = (char*)vm_shared_map(handle, header.bytes, header.address);
+	vm_shared_close(handle);
+	if (!space) {
+		printf("\nCannot map shared arena %s at %p!\n", name, header.address);
+		return -1;
+	}
 
-	ReleaseMutex(cachep->mutex);
-	ReleaseMutex(slab_manager->slab_mutex);
+	lock_set_process_shared(1);
+	attach_buddy_manager(space + BLOCK_SIZE);
+	buddy_manager = get_buddy_manager();
+	slab_manager = (SlabManager*)(buddy_manager + 1);
+	return 0;
 }
 
-SlabMetaData* get_slab_by_object_from_cache(kmem_cache_t* cachep, void* obj, int* type) {
-
-	WaitForSingleObject(slab_manager->list_mutex, INFINITE);
+int kmem_shared_unlink(const char* name) {
+	return vm_shared_unlink(name);
+}
+#endif
 
-	SlabMetaData* iterator = cachep->full_slabs;
+// Callers must hold main_mutex
+void cache_chain_add(kmem_cache_t* cachep) {
+	kmem_cache_t* iterator = &slab_manager->cache_of_caches, * prev = NULL;
 	while (iterator) {
-		void* starting_slot = iterator->starting_slot;
-		if ((unsigned)obj >= (unsigned)iterator->starting_slot && (unsigned)obj < ((unsigned)iterator + BLOCK_SIZE * cachep->slab_size_in_blocks)) {
-			*type = 1;
-			ReleaseMutex(slab_manager->list_mutex);
-			return iterator;
-		}
+		prev = iterator;
 		iterator = iterator->next;
 	}
+	cachep->next = NULL;
+	if (prev) {
+		prev->next = cachep;
+	}
+}
 
-	iterator = cachep->mixed_slabs;
-	while (iterator) {
-		if ((unsigned)obj >= (unsigned)iterator->starting_slot && (unsigned)obj < ((unsigned)iterator + BLOCK_SIZE * cachep->slab_size_in_blocks)) {
-			*type = 2;
-			ReleaseMutex(slab_manager->list_mutex);
-			return iterator;
-		}
+// Callers must hold main_mutex
+void cache_chain_remove(kmem_cache_t* cachep) {
+	kmem_cache_t* iterator = &slab_manager->cache_of_caches, * prev = NULL;
+	while (iterator && iterator != cachep) {
+		prev = iterator;
 		iterator = iterator->next;
 	}
+	if (iterator && prev) {
+		prev->next = iterator->next;
+	}
+}
 
-	iterator = cachep->empty_slabs;
+// Callers must hold main_mutex
+kmem_cache_t* find_merge_target(size_t size) {
+	kmem_cache_t* iterator = slab_manager->cache_of_caches.next;
 	while (iterator) {
-		if ((unsigned)obj >= (unsigned)iterator->starting_slot && (unsigned)obj < ((unsigned)iterator + BLOCK_SIZE * cachep->slab_size_in_blocks)) {
-			*type = 3;
-			ReleaseMutex(slab_manager->list_mutex);
+		if (iterator->merge_refcount && (size_t)iterator->object_size_in_bytes == size) {
 			return iterator;
 		}
 		iterator = iterator->next;
 	}
-
-	ReleaseMutex(slab_manager->list_mutex);
 	return NULL;
 }
 
-void kmem_cache_free(kmem_cache_t* cachep, void* objp) {
-
-	WaitForSingleObject(slab_manager->free_mutex, INFINITE);
-	WaitForSingleObject(cachep->mutex, INFINITE);
-
-	int type = -1;	//1 full, 2 mixed, 3 empty
-	SlabMetaData* slab = get_slab_by_object_from_cache(cachep, objp, &type);
-
-	if (!slab) {
-		ReleaseMutex(cachep->mutex);
-		ReleaseMutex(slab_manager->free_mutex);
-		return;
+// Fills in the fields an alias has, a descriptor of ALIAS_DESCRIPTOR_SIZE bytes holds nothing past them
+void initialize_alias(kmem_cache_t* alias, const char* name, size_t size, kmem_cache_t* backing) {
+
+	memset(alias, 0, ALIAS_DESCRIPTOR_SIZE);
+	strcpy(alias->name, name);
+	set_object_size(alias, size, 0);
+	alias->num_of_objects_in_slab = backing->num_of_objects_in_slab;
+	alias->slab_size_in_blocks = backing->slab_size_in_blocks;
+	alias->unused_space_in_bytes = backing->unused_space_in_bytes;
+	alias->off_slab = backing->off_slab;
+	alias->reap_warm_slabs = REAPER_DEFAULT_WARM_SLABS;
+	alias->reap_idle_ms = REAPER_DEFAULT_IDLE_MS;
+	alias->err = OK;
+	alias->backing = backing;
+
+	mutex_init(&alias->mutex);
+	spin_lock_init(&alias->depot.lock);
+	for (int i = 0; i < ALIAS_COUNTER_SLOTS; i++) {
+		spin_lock_init(&alias->thread_caches[i].lock);
 	}
+}
 
-	int slot = ((unsigned)objp - (unsigned)slab->starting_slot) / cachep->object_size_in_bytes;
-	int index = slot / bits_in_unsigned;
-	int deg = slot % bits_in_unsigned;
-	unsigned mask = ~(int)(1 << deg);
-	slab->bitvector_start[index] &= mask;
-
-	SlabMetaData* iterator = NULL, * prev = NULL;;
-	if (type == 1) {
-		iterator = cachep->full_slabs;
-	}
-	else if (type == 2) {
-		iterator = cachep->mixed_slabs;
-	}
-	else {
-		iterator = cachep->empty_slabs;
-	}
+// The alias can be passed anywhere a cache is expected, only its name, size and counters are its own
+kmem_cache_t* create_cache_alias(const char* name, size_t size) {
 
-	while (iterator != slab) {
-		prev = iterator;
-		iterator = iterator->next;
-	}
+	size_t merged_size = (size + MERGE_ALIGNMENT - 1) & ~(MERGE_ALIGNMENT - 1);
 
-	if (prev) {
-		prev->next = iterator->next;
-	}
-	else {
-		if (type == 1) {
-			cachep->full_slabs = cachep->full_slabs->next;
-		}
-		else if (type == 2) {
-			cachep->mixed_slabs = cachep->mixed_slabs->next;
+	// Both descriptors are allocated up front, allocating under main_mutex could not reclaim memory on failure
+	kmem_cache_t* alias = (kmem_cache_t*)cache_alloc_reclaim(&(slab_manager->alias_cache));
+	kmem_cache_t* spare = (kmem_cache_t*)cache_alloc_reclaim(&(slab_manager->cache_of_caches));
+	if (!alias || !spare) {
+		if (alias) {
+			cache_free(&(slab_manager->alias_cache), alias);
 		}
-		else if (type == 3) {
-			cachep->empty_slabs = cachep->empty_slabs->next;
+		if (spare) {
+			cache_free(&(slab_manager->cache_of_caches), spare);
 		}
+		return NULL;
 	}
 
-	slab->next = NULL;
-	slab->free_slot_cnt++;
-
+	mutex_lock(&slab_manager->main_mutex);
 
-	if (slab->free_slot_cnt == cachep->num_of_objects_in_slab) {
-		slab->next = cachep->empty_slabs;
-		cachep->empty_slabs = slab;
-	} else {
-		slab->next = cachep->mixed_slabs;
-		cachep->mixed_slabs = slab;
+	kmem_cache_t* backing = find_merge_target(merged_size);
+	if (!backing) {
+		backing = spare;
+		spare = NULL;
+		char backing_name[sizeof(backing->name)];
+		snprintf(backing_name, sizeof(backing_name), "%s_%d", merged_cache_name, (int)merged_size);
+		initialize_cache(backing, backing_name, merged_size, 0, NULL, NULL);
+		cache_chain_add(backing);
 	}
+	backing->merge_refcount++;
 
-	ReleaseMutex(cachep->mutex);
-	ReleaseMutex(slab_manager->free_mutex);
-}
+	initialize_alias(alias, name, size, backing);
+	cache_chain_add(alias);
 
-// Alloacate one small memory buffer
-void* kmalloc(size_t size) {
-	//WaitForSingleObject(slab_manager->main_mutex, INFINITE);
-	int deg = log2(next_power_of_two(size));
-	deg = 0;
-	int cnt = 1;
-	while (cnt < size) {
-		cnt <<= 1;
-		deg++;
-	}
+	mutex_unlock(&slab_manager->main_mutex);
 
-	kmem_cache_t* cachep = &slab_manager->small_buffer_caches[deg - STARTING_BUFFER_DEGREE];
-	unsigned ptr =(unsigned)kmem_cache_alloc(cachep);
-	//ReleaseMutex(slab_manager->main_mutex, INFINITE);
-	return (void*)ptr;
+	if (spare) {
+		cache_free(&(slab_manager->cache_of_caches), spare);
+	}
+	return alias;
 }
 
-SlabMetaData* get_slab_by_object_from_buffer(void* obj, int *type) {
-
-	WaitForSingleObject(slab_manager->list_mutex, INFINITE);
-
-	for (int i = 0; i <= NUMBER_OF_BUFFER_DEGREES; i++) {
-		kmem_cache_t* cachep = &slab_manager->small_buffer_caches[i];
-
-		SlabMetaData* iterator = cachep->full_slabs;
-		while (iterator) {
-			if ((unsigned)obj >= (unsigned)iterator->starting_slot && (unsigned)obj < ((unsigned)iterator + BLOCK_SIZE * cachep->slab_size_in_blocks)) {
-				*type = 1;
-				ReleaseMutex(slab_manager->list_mutex);
-				return iterator;
-			}
-			iterator = iterator->next;
-		}
+kmem_cache_t* kmem_cache_create_aligned(const char* name, size_t size, size_t align, void(*ctor)(void*), void(*dtor)(void*), unsigned flags) {
 
-		iterator = cachep->mixed_slabs;
-		while (iterator) {
-			if ((unsigned)obj >= (unsigned)iterator->starting_slot && (unsigned)obj < ((unsigned)iterator + BLOCK_SIZE * cachep->slab_size_in_blocks)) {
-				*type = 2;
-				ReleaseMutex(slab_manager->list_mutex);
-				return iterator;
-			}
-			iterator = iterator->next;
-		}
+	if ((align & (align - 1)) || align > BLOCK_SIZE) {
+		printf("\nCache alignment %zu is not a power of two up to a block!\n", align);
+		return NULL;
+	}
 
-		iterator = cachep->empty_slabs;
-		while (iterator) {
-			if ((unsigned)obj >= (unsigned)iterator->starting_slot && (unsigned)obj < ((unsigned)iterator + BLOCK_SIZE * cachep->slab_size_in_blocks)) {
-				*type = 3;
-				ReleaseMutex(slab_manager->list_mutex);
-				return iterator;
-			}
-			iterator = iterator->next;
-		}
+	// A function pointer means nothing in another process
+	if (slab_manager->shared && (ctor || dtor)) {
+		printf("\nCaches of a shared arena cannot have a ctor or dtor!\n");
+		return NULL;
 	}
 
-	return NULL;
-}
+	// Objects of a cache with a ctor or dtor carry state between uses, so such caches are never shared.
+	// Shared caches are naturally aligned, a cache asking for more gets slabs of its own.
+	size_t merged_size = (size + MERGE_ALIGNMENT - 1) & ~(MERGE_ALIGNMENT - 1);
+	if (!ctor && !dtor && !(flags & KMEM_CACHE_NO_MERGE) && (int)align <= natural_alignment(merged_size)) {
+		return create_cache_alias(name, size);
+	}
 
-void kfree(const void* objp) {
+	// main_mutex only guards the cache chain, the descriptor is allocated before taking it
+	kmem_cache_t* created_cache = (kmem_cache_t*)cache_alloc_reclaim(&(slab_manager->cache_of_caches));
+	if (!created_cache) {
+		return NULL;
+	}
+	initialize_cache(created_cache, name, size, align, ctor, dtor);
 
-	WaitForSingleObject(slab_manager->main_mutex, INFINITE);
+	mutex_lock(&slab_manager->main_mutex);
+	cache_chain_add(created_cache);
+	mutex_unlock(&slab_manager->main_mutex);
 
-	int type = -1;	//1 full, 2 mixed, 3 empty
-	SlabMetaData* slab = get_slab_by_object_from_buffer(objp, &type);
-	kmem_cache_t* cachep = slab->my_cache;
+	return created_cache;
+}
 
-	ReleaseMutex(slab_manager->main_mutex);
+kmem_cache_t* kmem_cache_create_flags(const char* name, size_t size, void(*ctor)(void*), void(*dtor)(void*), unsigned flags) {
+	return kmem_cache_create_aligned(name, size, 0, ctor, dtor, flags);
+}
 
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, void(*ctor)(void*), void(*dtor)(void*)) {
+	return kmem_cache_create_flags(name, size, ctor, dtor, 0);
+}
 
-	WaitForSingleObject(cachep->mutex, INFINITE);
+// How a process attached to a shared arena gets at the caches the others created
+kmem_cache_t* kmem_cache_find(const char* name) {
 
-	int slot = ((unsigned)objp - (unsigned)slab->starting_slot) / cachep->object_size_in_bytes;
-	int index = slot / bits_in_unsigned;
-	int deg = slot % bits_in_unsigned;
-	unsigned mask = ~(int)pow(2, deg);
-	slab->bitvector_start[index] &= mask;
+	kmem_cache_t* found = NULL;
+	mutex_lock(&slab_manager->main_mutex);
+	for (kmem_cache_t* iterator = slab_manager->cache_of_caches.next; iterator; iterator = iterator->next) {
+		if (!strcmp(iterator->name, name)) {
+			found = iterator;
+			break;
+		}
+	}
+	mutex_unlock(&slab_manager->main_mutex);
+	return found;
+}
 
-	SlabMetaData* iterator = NULL, * prev = NULL;;
-	if (type == 1) {
-		iterator = cachep->full_slabs;
+SlabMetaData** get_slab_list_head(kmem_cache_t* cachep, slab_list list) {
+	if (list == FULL_SLABS) {
+		return &cachep->full_slabs;
+	}
+	if (list == MIXED_SLABS) {
+		return &cachep->mixed_slabs;
 	}
-	else if (type == 2) {
-		iterator = cachep->mixed_slabs;
+	return &cachep->empty_slabs;
+}
+
+void slab_list_remove(kmem_cache_t* cachep, SlabMetaData* slab) {
+	if (slab->prev) {
+		slab->prev->next = slab->next;
 	}
 	else {
-		iterator = cachep->empty_slabs;
+		*get_slab_list_head(cachep, slab->list) = slab->next;
 	}
+	if (slab->next) {
+		slab->next->prev = slab->prev;
+	}
+	if (slab->list == EMPTY_SLABS) {
+		if (cachep->empty_slabs_tail == slab) {
+			cachep->empty_slabs_tail = slab->prev;
+		}
+		cachep->empty_slab_count--;
+	}
+	slab->next = slab->prev = NULL;
+	slab->list = NO_SLABS;
+}
 
-	while (iterator != slab) {
-		prev = iterator;
-		iterator = iterator->next;
+// The reaper thread keeps reaper_clock current, without it the clock has to be read here
+unsigned reaper_now() {
+	if (atomic_load_int(&slab_manager->reaper_running)) {
+		return (unsigned)atomic_load_int(&slab_manager->reaper_clock);
 	}
+	return monotonic_time_ms();
+}
 
-	if (prev) {
-		prev->next = iterator->next;
+void slab_list_add(kmem_cache_t* cachep, SlabMetaData* slab, slab_list list) {
+	SlabMetaData** head = get_slab_list_head(cachep, list);
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head) {
+		(*head)->prev = slab;
 	}
-	else {
-		if (type == 1) {
-			cachep->full_slabs = cachep->full_slabs->next;
-		}
-		else if (type == 2) {
-			cachep->mixed_slabs = cachep->mixed_slabs->next;
-		}
-		else if (type == 3) {
-			cachep->empty_slabs = cachep->empty_slabs->next;
+	*head = slab;
+	slab->list = list;
+	if (list == EMPTY_SLABS) {
+		if (!slab->next) {
+			cachep->empty_slabs_tail = slab;
 		}
+		cachep->empty_slab_count++;
+		slab->empty_since = reaper_now();
 	}
+}
 
-	slab->next = NULL;
-	slab->free_slot_cnt++;
-
+void slab_list_move(kmem_cache_t* cachep, SlabMetaData* slab, slab_list list) {
+	slab_list_remove(cachep, slab);
+	slab_list_add(cachep, slab, list);
+}
 
-	if (slab->free_slot_cnt == cachep->num_of_objects_in_slab) {
-		slab->next = cachep->empty_slabs;
-		cachep->empty_slabs = slab;
+// Appends to the cold end of the empty list, for a slab that counts as empty since idle_since
+void slab_list_add_cold(kmem_cache_t* cachep, SlabMetaData* slab, unsigned idle_since) {
+	slab->next = NULL;
+	slab->prev = cachep->empty_slabs_tail;
+	if (slab->prev) {
+		slab->prev->next = slab;
 	}
 	else {
-		slab->next = cachep->mixed_slabs;
-		cachep->mixed_slabs = slab;
+		cachep->empty_slabs = slab;
 	}
+	cachep->empty_slabs_tail = slab;
+	cachep->empty_slab_count++;
+	slab->list = EMPTY_SLABS;
+	slab->empty_since = idle_since;
+}
 
-	ReleaseMutex(cachep->mutex);
+PageDescriptor* get_page_descriptor(const void* objp) {
+	// Wraps around for pointers below the arena, so a single comparison rejects both sides
+	uintptr_t offset = (uintptr_t)objp - (uintptr_t)buddy_manager->starting_block_adr;
+	if (offset / BLOCK_SIZE >= buddy_manager->number_of_blocks) {
+		return NULL;
+	}
+	return &slab_manager->page_descriptors[offset / BLOCK_SIZE];
 }
 
+void set_page_descriptors(Block* block, int size_in_blocks, SlabMetaData* slab, kmem_cache_t* cachep) {
+	PageDescriptor* descriptor = &slab_manager->page_descriptors[block - buddy_manager->starting_block_adr];
+	for (int i = 0; i < size_in_blocks; i++) {
+		descriptor[i].slab = slab;
+		descriptor[i].cache = cachep;
+	}
+}
 
-int get_free_index_bitvector(kmem_cache_t* cachep, SlabMetaData* slab) {
+// Slab layer: callers must hold cachep->mutex. Puts the slab on the list matching its free slot count
+void slab_refile(kmem_cache_t* cachep, SlabMetaData* slab) {
+	slab_list list = MIXED_SLABS;
+	if (!slab->free_slot_cnt) {
+		list = FULL_SLABS;
+	}
+	else if (slab->free_slot_cnt == cachep->num_of_objects_in_slab) {
+		list = EMPTY_SLABS;
+	}
+	if (slab->list != list) {
+		slab_list_move(cachep, slab, list);
+	}
+}
 
-	WaitForSingleObject(slab_manager->main_mutex, INFINITE);
+// Slab layer: callers must hold cachep->mutex. Claims every free slot of a bitvector word at once,
+// lowest first, so slots past num_of_objects_in_slab are never handed out
+int slab_take_objects(kmem_cache_t* cachep, SlabMetaData* slab, void** objects, int count) {
 
-	unsigned* bitvector = slab->bitvector_start;
-	int free_index = -1;
-	for (int i = 0; i < cachep->bitvector_size_in_unsigned; i++) {
-		int finished = 0;
-		for (int deg = 0; deg < 32; deg++) {
-			unsigned mask = 1 << deg;
-			if (!(mask & *(bitvector + i))) {
-				free_index = i * 32 + deg;
-				finished = 1;
-				//bitvector[i] |= mask;
-				break;
-			}
-		}
-		if (finished) {
+	int taken = 0;
+	while (taken < count && slab->free_slot_cnt) {
+		int free_index = get_free_index_bitvector(cachep, slab);
+		if (free_index == -1) {
 			break;
 		}
+
+		int index = free_index / bits_in_unsigned;
+		unsigned free_bits = ~slab->bitvector_start[index];
+		while (free_bits && taken < count && slab->free_slot_cnt) {
+			int deg = count_trailing_zeros(free_bits);
+			free_bits &= free_bits - 1;
+			slab->bitvector_start[index] |= 1u << deg;
+			slab->free_slot_cnt--;
+
+			int slot = index * bits_in_unsigned + deg;
+			objects[taken++] = (void*)((char*)slab->starting_slot + (size_t)slot * cachep->object_size_in_bytes);
+		}
 	}
 
-	ReleaseMutex(slab_manager->main_mutex);
-	return free_index;
+	slab_refile(cachep, slab);
+	return taken;
 }
 
-int kmem_cache_shrink(kmem_cache_t* cachep) {
-
-	WaitForSingleObject(cachep->mutex, INFINITE);
+// Slab layer: callers must hold cachep->mutex
+int slab_alloc_locked(kmem_cache_t* cachep, void** objects, int count) {
 
-	int freed = 0;
-	while (cachep->empty_slabs) {
-		SlabMetaData* to_delete_slab = cachep->empty_slabs;
-		cachep->empty_slabs = to_delete_slab->next;
+	int allocated = 0;
+	while (allocated < count) {
+		if (!cachep->empty_slabs && !cachep->mixed_slabs) {
+			get_slab(cachep);
+		}
 
-		Block* to_delete_block = (Block*)to_delete_slab;
-		put_buddy(to_delete_block, cachep->slab_size_in_blocks);
+		// get_slab has recorded why it could not grow the cache
+		SlabMetaData* slab = cachep->mixed_slabs ? cachep->mixed_slabs : cachep->empty_slabs;
+		if (!slab) {
+			break;
+		}
+
+		int taken = slab_take_objects(cachep, slab, objects + allocated, count - allocated);
+		if (!taken) {
+			printf("\n\nSLAB_SLOT_ALLOCATION_ERROR\n\n");
+			cachep->err = SLAB_SLOT_ALLOCATION_ERROR;
+			break;
+		}
+		allocated += taken;
+	}
+	return allocated;
+}
+
+// Takes up to count objects from the slab layer under a single acquisition of the cache lock
+int slab_alloc_batch(kmem_cache_t* cachep, void** objects, int count) {
+
+	mutex_lock(&cachep->mutex);
+
+	deferred_free_drain_locked(cachep);
+	int allocated = slab_alloc_locked(cachep, objects, count);
+
+	mutex_unlock(&cachep->mutex);
+	return allocated;
+}
+
+void* slab_alloc(kmem_cache_t* cachep) {
+	void* obj = NULL;
+	slab_alloc_batch(cachep, &obj, 1);
+	return obj;
+}
+
+// Never reclaims, for the allocator's own allocations made while it holds locks
+void* cache_alloc(kmem_cache_t* cachep) {
+
+	void* obj;
+	int magazine_size = cachep->magazine_size;
+	if (cachep->backing) {
+		obj = cache_alloc(cachep->backing);
+	}
+	else if (magazine_size) {
+		obj = magazine_layer_alloc(cachep, magazine_size);
+	}
+	else {
+		obj = slab_alloc(cachep);
+	}
+	if (obj) {
+		cache_account(cachep, 1, 0, 0);
+	}
+	return obj;
+}
+
+size_t cache_slab_blocks(kmem_cache_t* cachep) {
+	return (size_t)(cachep->backing ? cachep->backing : cachep)->slab_size_in_blocks;
+}
+
+void report_allocation_failure(kmem_cache_t* cachep, int failures) {
+	printf("\n\nBUDDY_ALLOCATION_ERROR\n\n");
+	cache_account(cachep, 0, 0, failures);
+}
+
+void* cache_alloc_reclaim(kmem_cache_t* cachep) {
+
+	void* obj = cache_alloc(cachep);
+	for (int stage = 0; !obj && stage < RECLAIM_STAGES; stage++) {
+		if (reclaim_memory(stage, cache_slab_blocks(cachep))) {
+			obj = cache_alloc(cachep);
+		}
+	}
+	if (!obj) {
+		report_allocation_failure(cachep, 1);
+	}
+	return obj;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cachep) {
+	void* obj = cache_alloc_reclaim(cachep);
+	profile_alloc(obj, (size_t)cachep->object_size_in_bytes);
+	return obj;
+}
+
+// Slab layer: callers must hold cachep->mutex
+void get_slab(kmem_cache_t* cachep) {
+
+	// Failures are reported by the public entry points once reclaim has not helped either
+	Block* block = get_buddy(cachep->slab_size_in_blocks);
+	if (!block) {
+		cachep->err = BUDDY_ALLOCATION_ERROR;
+		return;
+	}
+
+	SlabMetaData* slab;
+	char* objects_area;
+	if (cachep->off_slab) {
+		slab = (SlabMetaData*)cache_alloc(&slab_manager->slab_management_cache);
+		if (!slab) {
+			// The management cache only fails when the buddy allocator is out of memory
+			cachep->err = BUDDY_ALLOCATION_ERROR;
+			put_buddy(block, cachep->slab_size_in_blocks);
+			return;
+		}
+		objects_area = (char*)block;
+	}
+	else {
+		slab = (SlabMetaData*)block;
+		objects_area = (char*)block + objects_offset(cachep, cachep->bitvector_size_in_unsigned);
+	}
+	slab->my_cache = cachep;
+
+	SlabMetaData* bitvector_start = slab + 1;
+	slab->bitvector_start = (unsigned*)bitvector_start;
+	for (int i = 0; i < cachep->bitvector_size_in_unsigned; i++) {
+		*(slab->bitvector_start + i) = 0;
+	}
+
+	// Colours are whole cache lines, or whole alignment units for objects aligned to more than a line
+	int colour = cachep->align > CACHE_L1_LINE_SIZE ? cachep->align : CACHE_L1_LINE_SIZE;
+	slab->colour_offset = 0;
+	if (L1_CACHE_ALIGNMENT && (cachep->unused_space_in_bytes / colour)) {
+		unsigned cache_offset = rand() % (cachep->unused_space_in_bytes / colour);
+		slab->colour_offset = cache_offset * colour;
+	}
+	slab->starting_slot = (void*)(objects_area + slab->colour_offset);
+
+	slab->free_slot_cnt = cachep->num_of_objects_in_slab;
+	slab->free_word_hint = 0;
+
+	// Objects are constructed once here and stay constructed across kmem_cache_free / kmem_cache_alloc
+	// The cache lock is held, an allocation inside the ctor must not start reclaiming other caches
+	if (cachep->ctor) {
+		reclaim_disabled++;
+		for (int i = 0; i < cachep->num_of_objects_in_slab; i++) {
+			cachep->ctor((char*)slab->starting_slot + (size_t)i * cachep->object_size_in_bytes);
+		}
+		reclaim_disabled--;
+	}
+
+	slab->next = slab->prev = NULL;
+	slab_list_add(cachep, slab, EMPTY_SLABS);
+	set_page_descriptors(block, cachep->slab_size_in_blocks, slab, cachep);
+	locked_add_ull(&cachep->slab_grows, 1);
+}
+
+// Slab layer: callers must hold cachep->mutex. Only clears the slot, the caller re-files the returned slab
+SlabMetaData* slab_free_locked(kmem_cache_t* cachep, void* objp) {
+
+	PageDescriptor* descriptor = get_page_descriptor(objp);
+	if (!descriptor || descriptor->cache != cachep) {
+		return NULL;
+	}
+	SlabMetaData* slab = descriptor->slab;
+
+	int slot = ((char*)objp - (char*)slab->starting_slot) / cachep->object_size_in_bytes;
+	int index = slot / bits_in_unsigned;
+	int deg = slot % bits_in_unsigned;
+	unsigned mask = ~(int)(1 << deg);
+	slab->bitvector_start[index] &= mask;
+	if (index < slab->free_word_hint) {
+		slab->free_word_hint = index;
+	}
+
+	slab->free_slot_cnt++;
+	return slab;
+}
+
+// Slab layer: callers must hold cachep->mutex. Frees come mostly in runs of objects from the same slab,
+// so a slab is re-filed when its run ends rather than after every object. Returns the current run.
+SlabMetaData* slab_free_run_locked(kmem_cache_t* cachep, void* objp, SlabMetaData* run) {
+	SlabMetaData* slab = slab_free_locked(cachep, objp);
+	if (slab && slab != run) {
+		if (run) {
+			slab_refile(cachep, run);
+		}
+		run = slab;
+	}
+	return run;
+}
+
+// Returns count objects to the slab layer under a single acquisition of the cache lock.
+// If the lock is busy the objects are deferred to the next lock holder instead of waiting for it.
+void slab_free_batch(kmem_cache_t* cachep, void** objects, int count) {
+
+	if (!count) {
+		return;
+	}
+	if (!mutex_try_lock(&cachep->mutex)) {
+		if (cachep->object_size_in_bytes >= (int)sizeof(void*) && !cachep->ctor && !cachep->dtor) {
+			deferred_free_push(cachep, objects, count);
+			return;
+		}
+		mutex_lock(&cachep->mutex);
+	}
+
+	deferred_free_drain_locked(cachep);
+
+	SlabMetaData* run = NULL;
+	for (int i = 0; i < count; i++) {
+		run = slab_free_run_locked(cachep, objects[i], run);
+	}
+	if (run) {
+		slab_refile(cachep, run);
+	}
+
+	mutex_unlock(&cachep->mutex);
+}
+
+void slab_free(kmem_cache_t* cachep, void* objp) {
+	slab_free_batch(cachep, &objp, 1);
+}
+
+void cache_free(kmem_cache_t* cachep, void* objp) {
+
+	cache_account(cachep, 0, 1, 0);
+	if (cachep->backing) {
+		cache_free(cachep->backing, objp);
+		return;
+	}
+
+	int magazine_size = cachep->magazine_size;
+	if (magazine_size) {
+		magazine_layer_free(cachep, objp, magazine_size);
+	}
+	else {
+		slab_free(cachep, objp);
+	}
+}
+
+void kmem_cache_free(kmem_cache_t* cachep, void* objp) {
+	profile_free(objp);
+	cache_free(cachep, objp);
+}
+
+// Bypasses the magazines, the whole batch is served from the slabs under one lock acquisition
+int cache_alloc_bulk(kmem_cache_t* cachep, void** objects, int count) {
+
+	int allocated;
+	if (cachep->backing) {
+		allocated = cache_alloc_bulk(cachep->backing, objects, count);
+	}
+	else {
+		allocated = slab_alloc_batch(cachep, objects, count);
+	}
+	cache_account(cachep, allocated, 0, 0);
+	return allocated;
+}
+
+int kmem_cache_alloc_bulk(kmem_cache_t* cachep, void** objects, int count) {
+
+	int allocated = cache_alloc_bulk(cachep, objects, count);
+	for (int stage = 0; allocated < count && stage < RECLAIM_STAGES; stage++) {
+		if (reclaim_memory(stage, cache_slab_blocks(cachep))) {
+			allocated += cache_alloc_bulk(cachep, objects + allocated, count - allocated);
+		}
+	}
+	if (allocated < count) {
+		report_allocation_failure(cachep, 1);
+	}
+	for (int i = 0; i < allocated; i++) {
+		profile_alloc(objects[i], (size_t)cachep->object_size_in_bytes);
+	}
+	return allocated;
+}
+
+void cache_free_bulk(kmem_cache_t* cachep, void** objects, int count) {
+
+	cache_account(cachep, 0, count, 0);
+	if (cachep->backing) {
+		cache_free_bulk(cachep->backing, objects, count);
+		return;
+	}
+	slab_free_batch(cachep, objects, count);
+}
+
+void kmem_cache_free_bulk(kmem_cache_t* cachep, void** objects, int count) {
+	profile_free_bulk(objects, count);
+	cache_free_bulk(cachep, objects, count);
+}
+
+
+// Large buffers take a whole buddy run, its order lives in the descriptor of the first block
+void* kmalloc_large(size_t size) {
+	// Checked before rounding up, a size near SIZE_MAX would wrap around to a small run
+	if (size > ((size_t)BLOCK_SIZE << buddy_manager->largest_block_degree2)) {
+		return NULL;
+	}
+	int order = ceil_log2((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	if (order > buddy_manager->largest_block_degree2) {
+		return NULL;
+	}
+
+	Block* block = get_buddy((size_t)1 << order);
+	if (!block) {
+		return NULL;
+	}
+
+	PageDescriptor* descriptor = get_page_descriptor(block);
+	descriptor->large = 1;
+	descriptor->order = (unsigned char)order;
+	return block;
+}
+
+void kfree_large(PageDescriptor* descriptor, const void* objp) {
+	int order = descriptor->order;
+	descriptor->large = 0;
+	descriptor->order = 0;
+	put_buddy((Block*)objp, (size_t)1 << order);
+}
+
+// Alloacate one memory buffer
+void* kmalloc(size_t size) {
+	void* buffer;
+	if (size > KMALLOC_MAX_CACHE_SIZE) {
+		buffer = kmalloc_large(size);
+		size_t blocks = size / BLOCK_SIZE + (size % BLOCK_SIZE != 0);
+		for (int stage = 0; !buffer && stage < RECLAIM_STAGES; stage++) {
+			if (reclaim_memory(stage, blocks)) {
+				buffer = kmalloc_large(size);
+			}
+		}
+	}
+	else {
+		buffer = cache_alloc_reclaim(&slab_manager->small_buffer_caches[size_class_of(size)]);
+	}
+	profile_alloc(buffer, size);
+	return buffer;
+}
+
+void kfree(const void* objp) {
+
+	profile_free(objp);
+
+	PageDescriptor* descriptor = get_page_descriptor(objp);
+	if (!descriptor) {
+		return;
+	}
+	if (descriptor->large) {
+		if (((const char*)objp - (const char*)buddy_manager->starting_block_adr) % BLOCK_SIZE == 0) {
+			kfree_large(descriptor, objp);
+		}
+		return;
+	}
+	if (!descriptor->cache) {
+		return;
+	}
+
+	kmem_cache_t* cachep = descriptor->cache;
+	if (cachep < slab_manager->small_buffer_caches || cachep >= slab_manager->small_buffer_caches + NUMBER_OF_SIZE_CLASSES) {
+		return;
+	}
+
+	cache_free(cachep, (void*)objp);
+}
+
+
+// Slab layer: callers must hold cachep->mutex
+int get_free_index_bitvector(kmem_cache_t* cachep, SlabMetaData* slab) {
+
+	unsigned* bitvector = slab->bitvector_start;
+	int words = cachep->bitvector_size_in_unsigned;
+	int i = slab->free_word_hint;
+
+#if BITVECTOR_SIMD_SCAN
+	if (words - i >= SIMD_SCAN_MIN_WORDS) {
+		// Skip full words four at a time
+		__m128i full = _mm_set1_epi32(-1);
+		while (i + 4 <= words) {
+			__m128i chunk = _mm_loadu_si128((const __m128i*)(bitvector + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(chunk, full)) != 0xFFFF) {
+				break;
+			}
+			i += 4;
+		}
+	}
+#endif
+
+	for (; i < words; i++) {
+		if (bitvector[i] != ~0u) {
+			slab->free_word_hint = i;
+			return i * bits_in_unsigned + count_trailing_zeros(~bitvector[i]);
+		}
+	}
+
+	slab->free_word_hint = words;
+	return -1;
+}
+
+// -------------------------------------------------------------------------------------------------------------------------------
+// Deferred frees, a contention bypass: a free that finds the cache lock taken (usually by a thread refilling its
+// magazine) pushes the objects on a lock-free list of the cache instead of queueing behind it, and whoever takes the
+// lock next returns them to their slabs. There is no owner thread, any number of threads push and only the lock holder
+// takes the list, all of it at once, so there is no ABA problem. The link overwrites the first word of the object, so
+// caches with a ctor or dtor, whose free objects keep their state, and objects smaller than a pointer always wait.
+
+
+void deferred_free_set_next(void* objp, void* next) {
+	memcpy(objp, &next, sizeof(void*));
+}
+
+void* deferred_free_get_next(void* objp) {
+	void* next;
+	memcpy(&next, objp, sizeof(void*));
+	return next;
+}
+
+void deferred_free_push(kmem_cache_t* cachep, void** objects, int count) {
+
+	// Link the batch privately, then publish it with a single compare and swap.
+	// Pointers that are not objects of this cache are dropped here, as slab_free_locked would drop them.
+	void* first = NULL, * last = NULL;
+	for (int i = 0; i < count; i++) {
+		PageDescriptor* descriptor = get_page_descriptor(objects[i]);
+		if (!descriptor || descriptor->cache != cachep) {
+			continue;
+		}
+		if (last) {
+			deferred_free_set_next(last, objects[i]);
+		}
+		else {
+			first = objects[i];
+		}
+		last = objects[i];
+	}
+	if (!first) {
+		return;
+	}
+
+	void* head = atomic_load_ptr(&cachep->deferred_frees);
+	while (1) {
+		deferred_free_set_next(last, head);
+		void* seen = atomic_compare_exchange_ptr(&cachep->deferred_frees, head, first);
+		if (seen == head) {
+			break;
+		}
+		head = seen;
+	}
+}
+
+// Slab layer: callers must hold cachep->mutex
+void deferred_free_drain_locked(kmem_cache_t* cachep) {
+
+	if (!atomic_load_ptr(&cachep->deferred_frees)) {
+		return;
+	}
+
+	void* objp = atomic_exchange_ptr(&cachep->deferred_frees, NULL);
+	SlabMetaData* run = NULL;
+	while (objp) {
+		void* next = deferred_free_get_next(objp);
+		run = slab_free_run_locked(cachep, objp, run);
+		objp = next;
+	}
+	if (run) {
+		slab_refile(cachep, run);
+	}
+}
+
+// -------------------------------------------------------------------------------------------------------------------------------
+// Magazine layer: every thread owns a loaded and a previous magazine per cache and exchanges whole magazines
+// with the cache depot, so the common kmem_cache_alloc / kmem_cache_free path touches no shared lock.
+// The previous magazine is always either full or empty.
+
+
+static THREAD_LOCAL int thread_cache_index = -1;
+static volatile int thread_cache_counter = 0;
+
+int get_thread_cache_index() {
+	if (thread_cache_index == -1) {
+		thread_cache_index = atomic_fetch_add_int(&thread_cache_counter, 1) % THREAD_CACHE_NUMBER;
+	}
+	return thread_cache_index;
+}
+
+// Counted per thread slot, so threads working on the same cache do not bounce one counter between them
+void cache_account(kmem_cache_t* cachep, int allocs, int frees, int failures) {
+	int index = get_thread_cache_index();
+	if (cachep->backing) {
+		index %= ALIAS_COUNTER_SLOTS;
+	}
+	ThreadCache* tc = &cachep->thread_caches[index];
+	if (allocs) {
+		atomic_add_ull(&tc->allocs, allocs);
+	}
+	if (frees) {
+		atomic_add_ull(&tc->frees, frees);
+	}
+	if (failures) {
+		atomic_add_ull(&tc->failures, failures);
+	}
+}
+
+// Only contended when more than THREAD_CACHE_NUMBER threads share a cache, or while the cache is being drained
+void thread_cache_lock(ThreadCache* tc) {
+	spin_lock(&tc->lock);
+}
+
+void thread_cache_unlock(ThreadCache* tc) {
+	spin_unlock(&tc->lock);
+}
+
+Magazine* magazine_alloc() {
+	Magazine* magazine = (Magazine*)cache_alloc(&slab_manager->magazine_cache);
+	if (magazine) {
+		magazine->next = NULL;
+		magazine->rounds = 0;
+	}
+	return magazine;
+}
+
+void magazine_free(Magazine* magazine) {
+	cache_free(&slab_manager->magazine_cache, magazine);
+}
+
+void depot_put(Depot* depot, Magazine* magazine, int full) {
+
+	spin_lock(&depot->lock);
+
+	if (full) {
+		magazine->next = depot->full_magazines;
+		depot->full_magazines = magazine;
+		depot->full_cnt++;
+	}
+	else {
+		magazine->next = depot->empty_magazines;
+		depot->empty_magazines = magazine;
+		depot->empty_cnt++;
+	}
+
+	spin_unlock(&depot->lock);
+}
+
+// A few full magazines per thread slot in use, so the depot cannot grow with the peak number of freed objects
+int depot_full(Depot* depot) {
+
+	int slots = atomic_load_int(&thread_cache_counter);
+	if (slots > THREAD_CACHE_NUMBER) {
+		slots = THREAD_CACHE_NUMBER;
+	}
+
+	spin_lock(&depot->lock);
+	int full = depot->full_cnt >= DEPOT_FULL_PER_SLOT * slots;
+	spin_unlock(&depot->lock);
+	return full;
+}
+
+// Takes a full (or empty) magazine from the depot and, only if one was taken, gives back the opposite kind in its place
+Magazine* depot_exchange(Depot* depot, Magazine* returned, int want_full) {
+
+	spin_lock(&depot->lock);
+
+	Magazine* taken = want_full ? depot->full_magazines : depot->empty_magazines;
+	if (taken) {
+		if (want_full) {
+			depot->full_magazines = taken->next;
+			if (--depot->full_cnt < depot->full_min) {
+				depot->full_min = depot->full_cnt;
+			}
+		}
+		else {
+			depot->empty_magazines = taken->next;
+			if (--depot->empty_cnt < depot->empty_min) {
+				depot->empty_min = depot->empty_cnt;
+			}
+		}
+		taken->next = NULL;
+
+		if (returned) {
+			if (want_full) {
+				returned->next = depot->empty_magazines;
+				depot->empty_magazines = returned;
+				depot->empty_cnt++;
+			}
+			else {
+				returned->next = depot->full_magazines;
+				depot->full_magazines = returned;
+				depot->full_cnt++;
+			}
+		}
+	}
+
+	spin_unlock(&depot->lock);
+	return taken;
+}
+
+void magazine_drain(kmem_cache_t* cachep, Magazine* magazine) {
+	while (magazine) {
+		Magazine* next = magazine->next;
+		if (magazine->rounds) {
+			slab_free_batch(cachep, magazine->objects, magazine->rounds);
+		}
+		magazine_free(magazine);
+		magazine = next;
+	}
+}
+
+void* magazine_layer_alloc(kmem_cache_t* cachep, int magazine_size) {
+
+	ThreadCache* tc = &cachep->thread_caches[get_thread_cache_index()];
+	void* obj = NULL;
+
+	thread_cache_lock(tc);
+	while (1) {
+		if (tc->loaded && tc->loaded->rounds) {
+			obj = tc->loaded->objects[--tc->loaded->rounds];
+			break;
+		}
+
+		if (tc->previous && tc->previous->rounds) {
+			Magazine* tmp = tc->loaded;
+			tc->loaded = tc->previous;
+			tc->previous = tmp;
+			continue;
+		}
+
+		Magazine* full = depot_exchange(&cachep->depot, tc->previous, 1);
+		if (full) {
+			tc->previous = tc->loaded;
+			tc->loaded = full;
+			continue;
+		}
+
+		// Depot is out of full magazines. The loaded one is refilled from the slab layer without the slot lock, so a
+		// thread sharing the slot or draining the cache does not spin behind a slab grow
+		Magazine* refill = tc->loaded;
+		tc->loaded = NULL;
+		thread_cache_unlock(tc);
+
+		if (!refill && !(refill = magazine_alloc())) {
+			return slab_alloc(cachep);
+		}
+		refill->rounds = slab_alloc_batch(cachep, refill->objects, magazine_size);
+		if (refill->rounds) {
+			obj = refill->objects[--refill->rounds];
+		}
+
+		thread_cache_lock(tc);
+		if (!tc->loaded) {
+			tc->loaded = refill;
+			refill = NULL;
+		}
+		thread_cache_unlock(tc);
+
+		// Another thread loaded the slot meanwhile
+		if (refill) {
+			magazine_drain(cachep, refill);
+		}
+		return obj;
+	}
+	thread_cache_unlock(tc);
+
+	return obj;
+}
+
+void magazine_layer_free(kmem_cache_t* cachep, void* objp, int magazine_size) {
+
+	ThreadCache* tc = &cachep->thread_caches[get_thread_cache_index()];
+
+	thread_cache_lock(tc);
+	while (1) {
+		if (tc->loaded && tc->loaded->rounds < magazine_size) {
+			tc->loaded->objects[tc->loaded->rounds++] = objp;
+			thread_cache_unlock(tc);
+			return;
+		}
+
+		if (tc->previous && !tc->previous->rounds) {
+			Magazine* tmp = tc->loaded;
+			tc->loaded = tc->previous;
+			tc->previous = tmp;
+			continue;
+		}
+
+		Magazine* empty = depot_exchange(&cachep->depot, tc->previous, 0);
+		if (empty) {
+			tc->previous = tc->loaded;
+			tc->loaded = empty;
+			continue;
+		}
+
+		// Depot is out of empty magazines. The full previous one is traded for an empty one without the slot lock,
+		// as that frees to the slab layer or grows the magazine cache
+		Magazine* full = tc->previous;
+		tc->previous = NULL;
+		thread_cache_unlock(tc);
+
+		if (!full || !depot_full(&cachep->depot)) {
+			empty = magazine_alloc();
+		}
+		if (full && !empty) {
+			// Rather than parking the full magazine, its objects go back to their slabs
+			slab_free_batch(cachep, full->objects, full->rounds);
+			full->rounds = 0;
+			empty = full;
+		}
+		else if (full) {
+			depot_put(&cachep->depot, full, 1);
+		}
+
+		// No magazine could be had, hand the object straight back to its slab
+		if (!empty) {
+			slab_free(cachep, objp);
+			return;
+		}
+		empty->objects[empty->rounds++] = objp;
+
+		thread_cache_lock(tc);
+		if (!tc->previous) {
+			tc->previous = tc->loaded;
+			tc->loaded = empty;
+			empty = NULL;
+		}
+		thread_cache_unlock(tc);
+
+		// Another thread refilled the slot meanwhile
+		if (empty) {
+			magazine_drain(cachep, empty);
+		}
+		return;
+	}
+}
+
+// Returns every object cached in thread magazines and in the depot back to the slab layer
+void magazine_layer_drain(kmem_cache_t* cachep) {
+
+	for (int i = 0; i < THREAD_CACHE_NUMBER; i++) {
+		ThreadCache* tc = &cachep->thread_caches[i];
+
+		thread_cache_lock(tc);
+		Magazine* loaded = tc->loaded;
+		Magazine* previous = tc->previous;
+		tc->loaded = tc->previous = NULL;
+		thread_cache_unlock(tc);
+
+		if (loaded) {
+			loaded->next = NULL;
+			magazine_drain(cachep, loaded);
+		}
+		if (previous) {
+			previous->next = NULL;
+			magazine_drain(cachep, previous);
+		}
+	}
+
+	spin_lock(&cachep->depot.lock);
+	Magazine* full_magazines = cachep->depot.full_magazines;
+	Magazine* empty_magazines = cachep->depot.empty_magazines;
+	cachep->depot.full_magazines = cachep->depot.empty_magazines = NULL;
+	cachep->depot.full_cnt = cachep->depot.empty_cnt = 0;
+	cachep->depot.full_min = cachep->depot.empty_min = 0;
+	spin_unlock(&cachep->depot.lock);
+
+	magazine_drain(cachep, full_magazines);
+	magazine_drain(cachep, empty_magazines);
+}
+
+// On an alias this tunes the shared cache, so every alias of it sees the new depth. Init only: call it before anything
+// allocates from the cache, a thread in the middle of a magazine operation could still fill a magazine to the old depth.
+int kmem_cache_set_magazine_size(kmem_cache_t* cachep, int size) {
+
+	if (cachep->backing) {
+		cachep = cachep->backing;
+	}
+
+	// The internal caches are used on the magazine slow path or by get_slab, they never get magazines
+	if (cachep == &slab_manager->cache_of_caches || cachep == &slab_manager->magazine_cache ||
+		cachep == &slab_manager->slab_management_cache || cachep == &slab_manager->alias_cache) {
+		return cachep->magazine_size;
+	}
+
+	if (size < 0) {
+		size = 0;
+	}
+	if (size > MAGAZINE_MAX_SIZE) {
+		size = MAGAZINE_MAX_SIZE;
+	}
+
+	cachep->magazine_size = size;
+	magazine_layer_drain(cachep);
+	return size;
+}
+
+// Slab layer: callers must hold cachep->mutex
+Block* get_slab_block(kmem_cache_t* cachep, SlabMetaData* slab) {
+	if (cachep->off_slab) {
+		return (Block*)((char*)slab->starting_slot - slab->colour_offset);
+	}
+	return (Block*)slab;
+}
+
+void release_slab(kmem_cache_t* cachep, SlabMetaData* slab) {
+	slab_list_remove(cachep, slab);
+	locked_add_ull(&cachep->slab_shrinks, 1);
+
+	if (cachep->dtor) {
+		reclaim_disabled++;
+		for (int i = 0; i < cachep->num_of_objects_in_slab; i++) {
+			cachep->dtor((char*)slab->starting_slot + (size_t)i * cachep->object_size_in_bytes);
+		}
+		reclaim_disabled--;
+	}
+
+	Block* block = get_slab_block(cachep, slab);
+	set_page_descriptors(block, cachep->slab_size_in_blocks, NULL, NULL);
+	if (cachep->off_slab) {
+		cache_free(&slab_manager->slab_management_cache, slab);
+	}
+	put_buddy(block, cachep->slab_size_in_blocks);
+}
+
+int kmem_cache_shrink(kmem_cache_t* cachep) {
+
+	if (cachep->backing) {
+		cachep = cachep->backing;
+	}
+
+	magazine_layer_drain(cachep);
+
+	mutex_lock(&cachep->mutex);
+
+	deferred_free_drain_locked(cachep);
+
+	int freed = 0;
+	while (cachep->empty_slabs) {
+		release_slab(cachep, cachep->empty_slabs);
 		freed += cachep->slab_size_in_blocks;
 	}
 
-	ReleaseMutex(cachep->mutex);
+	mutex_unlock(&cachep->mutex);
 	return freed;
 }
 
-void kmem_cache_destroy(kmem_cache_t* cachep) {
+// Releases every slab of the cache, including those still holding objects
+void release_all_slabs(kmem_cache_t* cachep) {
 
-	if (cachep == &slab_manager->cache_of_caches) {
-		return;
-	}
+	magazine_layer_drain(cachep);
 
-	WaitForSingleObject(cachep->mutex, INFINITE);	
+	mutex_lock(&cachep->mutex);	
 
 	/*if (cachep->full_slabs || cachep->mixed_slabs) {
 		printf("\n\nCACHE_CANNOT_BE_DELETED\n\n");
 		cachep->err = CACHE_CANNOT_BE_DELETED;
-		ReleaseMutex(cachep->mutex);
+		mutex_unlock(&cachep->mutex);
 		return;
 	}*/
 
-	while (cachep->full_slabs) {
-		SlabMetaData* to_delete_slab = cachep->full_slabs;
-		cachep->full_slabs = to_delete_slab->next;
+	// Every slab goes away below, deferred frees still waiting go with them
+	atomic_exchange_ptr(&cachep->deferred_frees, NULL);
 
-		Block* to_delete_block = (Block*)to_delete_slab;
-		put_buddy(to_delete_block, cachep->slab_size_in_blocks);
+	while (cachep->full_slabs) {
+		release_slab(cachep, cachep->full_slabs);
 	}
 
 	while (cachep->mixed_slabs) {
-		SlabMetaData* to_delete_slab = cachep->mixed_slabs;
-		cachep->mixed_slabs = to_delete_slab->next;
+		release_slab(cachep, cachep->mixed_slabs);
+	}
 
-		Block* to_delete_block = (Block*)to_delete_slab;
-		put_buddy(to_delete_block, cachep->slab_size_in_blocks);
+	while (cachep->empty_slabs) {
+		release_slab(cachep, cachep->empty_slabs);
 	}
 
-	kmem_cache_shrink(cachep);
+	mutex_unlock(&cachep->mutex);
+}
 
+// Destroying an alias only detaches it, objects it still holds stay in the shared cache until the last alias is gone
+void kmem_cache_destroy(kmem_cache_t* cachep) {
 
-	kmem_cache_t* iterator = &slab_manager->cache_of_caches, * prev = NULL;
-	while (iterator != cachep) {
-		prev = iterator;
-		iterator = iterator->next;
-	}
-	if (prev) {
-		prev->next = iterator->next;
+	// The internal caches live inside SlabManager and are never destroyed
+	if ((char*)cachep >= (char*)slab_manager && (char*)cachep < (char*)(slab_manager + 1)) {
+		return;
 	}
 
+	kmem_cache_t* backing = cachep->backing;
+	kmem_cache_t* released = cachep;
+
+	mutex_lock(&slab_manager->main_mutex);
+	cache_chain_remove(cachep);
+	if (backing) {
+		released = NULL;
+		if (--backing->merge_refcount == 0) {
+			cache_chain_remove(backing);
+			released = backing;
+		}
+	}
+	mutex_unlock(&slab_manager->main_mutex);
 
-	ReleaseMutex(cachep->mutex);
+	if (released) {
+		release_all_slabs(released);
+		cache_free(&slab_manager->cache_of_caches, released);
+	}
+	if (backing) {
+		cache_free(&slab_manager->alias_cache, cachep);
+	}
 }
 
 void kmem_cache_info(kmem_cache_t* cachep) {
 
-	WaitForSingleObject(slab_manager->print_mutex, INFINITE);
+	mutex_lock(&slab_manager->print_mutex);
 
-	printf("\n\Cache name -> %s\n", cachep->name);
+	kmem_cache_stats_t stats;
+	kmem_cache_get_stats(cachep, &stats);
+
+	printf("\nCache name -> %s\n", cachep->name);
 	printf("Object size in bytes -> %d\n", cachep->object_size_in_bytes);
+	printf("Allocations -> %llu\n", stats.allocs);
+	printf("Frees -> %llu\n", stats.frees);
+	printf("Failed allocations -> %llu\n", stats.failures);
+	if (cachep->backing) {
+		printf("Merged into -> %s (%d aliases)\n", cachep->backing->name, cachep->backing->merge_refcount);
+		cachep = cachep->backing;
+		kmem_cache_get_stats(cachep, &stats);
+	}
+	printf("Slab grows -> %llu\n", stats.slab_grows);
+	printf("Slab shrinks -> %llu\n", stats.slab_shrinks);
 	printf("Slab size in Blocks -> %d\n", cachep->slab_size_in_blocks);
 	printf("Max num of objects in slab -> %d\n", cachep->num_of_objects_in_slab);
 
@@ -677,13 +1907,532 @@ void kmem_cache_info(kmem_cache_t* cachep) {
 	printf("Total objects created -> %d\n", taken_space);
 	printf("Percentage of space used -> %lf\n", (double)taken_space / (double)(taken_space + free_space) * 100);
 	printf("Unused space inside slab -> %d\n", cachep->unused_space_in_bytes);
+	printf("Off-slab management -> %s\n", cachep->off_slab ? "yes" : "no");
+	printf("Magazine size -> %d\n", cachep->magazine_size);
+	printf("Full magazines in depot -> %d\n", cachep->depot.full_cnt);
+	printf("Empty magazines in depot -> %d\n", cachep->depot.empty_cnt);
 	if (L1_CACHE_ALIGNMENT) {
 		printf("Different L1_Cache alignments -> %d\n", (cachep->unused_space_in_bytes / CACHE_L1_LINE_SIZE));
 	}
 	printf("\n");
-	ReleaseMutex(slab_manager->print_mutex);
+	mutex_unlock(&slab_manager->print_mutex);
 }
 
 int kmem_cache_error(kmem_cache_t* cachep) {
+	if (cachep->backing) {
+		cachep = cachep->backing;
+	}
 	return cachep->err;
-}
\ No newline at end of file
+}
+
+// Reads only counters, neither the cache lock nor the slab lists are touched
+void kmem_cache_get_stats(kmem_cache_t* cachep, kmem_cache_stats_t* stats) {
+
+	memset(stats, 0, sizeof(*stats));
+	snprintf(stats->name, sizeof(stats->name), "%s", cachep->name);
+	stats->object_size = cachep->object_size_in_bytes;
+	stats->objects_per_slab = cachep->num_of_objects_in_slab;
+	stats->slab_size_in_blocks = cachep->slab_size_in_blocks;
+
+	// Frees are summed before allocations, so a free racing with the snapshot cannot make active_objects negative
+	int slots = cachep->backing ? ALIAS_COUNTER_SLOTS : THREAD_CACHE_NUMBER;
+	for (int i = 0; i < slots; i++) {
+		stats->frees += atomic_load_ull(&cachep->thread_caches[i].frees);
+	}
+	for (int i = 0; i < slots; i++) {
+		stats->allocs += atomic_load_ull(&cachep->thread_caches[i].allocs);
+		stats->failures += atomic_load_ull(&cachep->thread_caches[i].failures);
+	}
+	stats->active_objects = stats->allocs > stats->frees ? stats->allocs - stats->frees : 0;
+
+	// The slabs of an alias belong to the shared cache, which has an entry of its own
+	if (cachep->backing) {
+		snprintf(stats->merged_into, sizeof(stats->merged_into), "%s", cachep->backing->name);
+		return;
+	}
+
+	stats->slab_shrinks = atomic_load_ull(&cachep->slab_shrinks);
+	stats->slab_grows = atomic_load_ull(&cachep->slab_grows);
+	stats->active_slabs = stats->slab_grows > stats->slab_shrinks ? stats->slab_grows - stats->slab_shrinks : 0;
+}
+
+// Internal caches first, then the created ones in creation order. Callers must hold main_mutex.
+int for_each_cache_locked(void(*visit)(kmem_cache_t*, void*), void* arg) {
+
+	int count = 0;
+	visit(&slab_manager->cache_of_caches, arg);
+	visit(&slab_manager->magazine_cache, arg);
+	visit(&slab_manager->slab_management_cache, arg);
+	visit(&slab_manager->alias_cache, arg);
+	count += 4;
+	for (int i = 0; i < NUMBER_OF_SIZE_CLASSES; i++) {
+		visit(&slab_manager->small_buffer_caches[i], arg);
+		count++;
+	}
+	for (kmem_cache_t* iterator = slab_manager->cache_of_caches.next; iterator; iterator = iterator->next) {
+		visit(iterator, arg);
+		count++;
+	}
+	return count;
+}
+
+// main_mutex keeps the chain still meanwhile, it is only taken by kmem_cache_create and kmem_cache_destroy
+// so allocations go on undisturbed
+int for_each_cache(void(*visit)(kmem_cache_t*, void*), void* arg) {
+	mutex_lock(&slab_manager->main_mutex);
+	int count = for_each_cache_locked(visit, arg);
+	mutex_unlock(&slab_manager->main_mutex);
+	return count;
+}
+
+typedef struct stats_snapshot {
+	kmem_cache_stats_t* stats;
+	int max_caches;
+	int count;
+} StatsSnapshot;
+
+void stats_snapshot_visit(kmem_cache_t* cachep, void* arg) {
+	StatsSnapshot* snapshot = (StatsSnapshot*)arg;
+	if (snapshot->count < snapshot->max_caches) {
+		kmem_cache_get_stats(cachep, &snapshot->stats[snapshot->count]);
+	}
+	snapshot->count++;
+}
+
+int kmem_stats_snapshot(kmem_cache_stats_t* stats, int max_caches) {
+	StatsSnapshot snapshot = { stats, max_caches, 0 };
+	return for_each_cache(stats_snapshot_visit, &snapshot);
+}
+
+// snprintf style output: text past the end of the buffer is dropped but still counted
+typedef struct json_buffer {
+	char* buffer;
+	size_t size;
+	size_t length;
+	int caches;
+} JsonBuffer;
+
+void json_append(JsonBuffer* json, const char* format, ...) {
+	size_t left = json->length < json->size ? json->size - json->length : 0;
+
+	va_list args;
+	va_start(args, format);
+	int written = vsnprintf(left ? json->buffer + json->length : NULL, left, format, args);
+	va_end(args);
+
+	if (written > 0) {
+		json->length += written;
+	}
+}
+
+void json_append_string(JsonBuffer* json, const char* string) {
+	json_append(json, "\"");
+	for (; *string; string++) {
+		unsigned char c = (unsigned char)*string;
+		if (c == '"' || c == '\\') {
+			json_append(json, "\\%c", c);
+		}
+		else if (c < 0x20) {
+			json_append(json, "\\u%04x", c);
+		}
+		else {
+			json_append(json, "%c", c);
+		}
+	}
+	json_append(json, "\"");
+}
+
+void json_cache_visit(kmem_cache_t* cachep, void* arg) {
+	JsonBuffer* json = (JsonBuffer*)arg;
+
+	kmem_cache_stats_t stats;
+	kmem_cache_get_stats(cachep, &stats);
+
+	json_append(json, json->caches++ ? ",{\"name\":" : "{\"name\":");
+	json_append_string(json, stats.name);
+	json_append(json, ",\"merged_into\":");
+	json_append_string(json, stats.merged_into);
+	json_append(json, ",\"object_size\":%zu,\"objects_per_slab\":%d,\"slab_size_in_blocks\":%d", stats.object_size, stats.objects_per_slab, stats.slab_size_in_blocks);
+	json_append(json, ",\"allocs\":%llu,\"frees\":%llu,\"failures\":%llu,\"active_objects\":%llu", stats.allocs, stats.frees, stats.failures, stats.active_objects);
+	json_append(json, ",\"slab_grows\":%llu,\"slab_shrinks\":%llu,\"active_slabs\":%llu}", stats.slab_grows, stats.slab_shrinks, stats.active_slabs);
+}
+
+int kmem_stats_json(char* buffer, size_t size) {
+
+	JsonBuffer json = { buffer, size, 0, 0 };
+	if (size) {
+		buffer[0] = '\0';
+	}
+
+	json_append(&json, "{\"caches\":[");
+	for_each_cache(json_cache_visit, &json);
+
+	BuddyStats buddy_stats;
+	get_buddy_stats(&buddy_stats);
+	json_append(&json, "],\"buddy\":{\"number_of_blocks\":%zu,\"free_blocks\":%zu,\"cached_blocks\":%zu,\"number_of_shards\":%d,\"orders\":[",
+		buddy_stats.number_of_blocks, buddy_stats.free_blocks, buddy_stats.cached_blocks, buddy_stats.number_of_shards);
+	for (int i = 0; i <= buddy_stats.largest_block_degree2; i++) {
+		BuddyOrderStats* order = &buddy_stats.orders[i];
+		json_append(&json, "%s{\"order\":%d,\"free_blocks\":%llu,\"splits\":%llu,\"merges\":%llu}",
+			i ? "," : "", i, order->free_blocks, order->splits, order->merges);
+	}
+	json_append(&json, "],\"released_blocks\":%llu},\"reaped_blocks\":%llu,\"pressure_reclaimed_blocks\":%llu}",
+		buddy_stats.released_blocks, atomic_load_ull(&slab_manager->reaped_blocks), atomic_load_ull(&slab_manager->pressure_reclaimed_blocks));
+
+	return (int)json.length;
+}
+
+
+// Slab layer: callers must hold cachep->mutex. The objects sat unused in the depot since idle_since, a slab they
+// leave empty counts as idle since then too, so the reap pass that flushed them can release it
+void slab_free_idle_locked(kmem_cache_t* cachep, void** objects, int count, unsigned idle_since) {
+	for (int i = 0; i < count; i++) {
+		SlabMetaData* slab = slab_free_locked(cachep, objects[i]);
+		if (!slab) {
+			continue;
+		}
+		if (slab->free_slot_cnt == cachep->num_of_objects_in_slab) {
+			slab_list_remove(cachep, slab);
+			slab_list_add_cold(cachep, slab, idle_since);
+		}
+		else {
+			slab_refile(cachep, slab);
+		}
+	}
+}
+
+// Cuts a magazine list after its first keep magazines and returns the rest
+Magazine* depot_detach_cold(Magazine** head, int keep) {
+	while (*head && keep-- > 0) {
+		head = &(*head)->next;
+	}
+	Magazine* cold = *head;
+	*head = NULL;
+	return cold;
+}
+
+// Flushes the depot magazines nobody took for reap_idle_ms back to their slabs. Magazines come and go at the head of
+// the depot lists, so the fewest a list held over the window are the ones at its bottom that were never touched.
+void depot_reap(kmem_cache_t* cachep, unsigned now) {
+
+	Depot* depot = &cachep->depot;
+	if (cachep->backing) {
+		return;
+	}
+
+	mutex_lock(&cachep->mutex);
+	spin_lock(&depot->lock);
+	if ((int)(now - depot->window_start) < cachep->reap_idle_ms) {
+		spin_unlock(&depot->lock);
+		mutex_unlock(&cachep->mutex);
+		return;
+	}
+	Magazine* full = depot_detach_cold(&depot->full_magazines, depot->full_cnt - depot->full_min);
+	Magazine* empty = depot_detach_cold(&depot->empty_magazines, depot->empty_cnt - depot->empty_min);
+	depot->full_cnt -= depot->full_min;
+	depot->empty_cnt -= depot->empty_min;
+	unsigned idle_since = depot->window_start;
+	depot->full_min = depot->full_cnt;
+	depot->empty_min = depot->empty_cnt;
+	depot->window_start = now;
+	spin_unlock(&depot->lock);
+
+	for (Magazine* magazine = full; magazine; magazine = magazine->next) {
+		slab_free_idle_locked(cachep, magazine->objects, magazine->rounds, idle_since);
+		magazine->rounds = 0;
+	}
+	mutex_unlock(&cachep->mutex);
+
+	magazine_drain(cachep, full);
+	magazine_drain(cachep, empty);
+}
+
+// Releases the empty slabs idle for at least idle_ms from the cold end of the list, beyond the warm_slabs newest.
+// A negative warm_slabs applies the reap policy of the cache. The lock is dropped every REAPER_BATCH_SLABS slabs
+// so allocations are never held up for long.
+size_t release_empty_slabs(kmem_cache_t* cachep, unsigned now, int warm_slabs, int idle_ms) {
+
+	if (cachep->backing) {
+		return 0;
+	}
+
+	size_t reclaimed = 0;
+	int released;
+	do {
+		mutex_lock(&cachep->mutex);
+
+		deferred_free_drain_locked(cachep);
+		if (warm_slabs < 0) {
+			warm_slabs = cachep->reap_warm_slabs;
+			idle_ms = cachep->reap_idle_ms;
+		}
+
+		released = 0;
+		while (cachep->empty_slab_count > warm_slabs && released < REAPER_BATCH_SLABS) {
+			SlabMetaData* slab = cachep->empty_slabs_tail;
+			// Signed, a slab stamped by a clock tick that raced with this pass is simply not idle yet
+			if (idle_ms && (int)(now - slab->empty_since) < idle_ms) {
+				break;
+			}
+			release_slab(cachep, slab);
+			released++;
+		}
+		reclaimed += (size_t)released * cachep->slab_size_in_blocks;
+
+		mutex_unlock(&cachep->mutex);
+
+		if (released == REAPER_BATCH_SLABS) {
+			thread_yield();
+		}
+	} while (released == REAPER_BATCH_SLABS);
+
+	return reclaimed;
+}
+
+typedef struct reap_pass {
+	unsigned now;
+	size_t reclaimed;
+} ReapPass;
+
+void reap_visit(kmem_cache_t* cachep, void* arg) {
+	ReapPass* pass = (ReapPass*)arg;
+	depot_reap(cachep, pass->now);
+	pass->reclaimed += release_empty_slabs(cachep, pass->now, -1, 0);
+}
+
+size_t kmem_reap() {
+
+	unsigned now = monotonic_time_ms();
+	atomic_exchange_int(&slab_manager->reaper_clock, (int)now);
+
+	ReapPass pass = { now, 0 };
+	for_each_cache(reap_visit, &pass);
+
+	atomic_add_ull(&slab_manager->reaped_blocks, pass.reclaimed);
+	return pass.reclaimed;
+}
+
+// Sleeps in REAPER_TICK_MS steps, advancing the clock that slabs are stamped with and watching for kmem_reaper_stop
+void reaper_work(void* data) {
+	(void)data;
+
+	while (atomic_load_int(&slab_manager->reaper_running)) {
+		for (int slept = 0; slept < slab_manager->reaper_interval_ms && atomic_load_int(&slab_manager->reaper_running); slept += REAPER_TICK_MS) {
+			thread_sleep_ms(REAPER_TICK_MS);
+			atomic_exchange_int(&slab_manager->reaper_clock, (int)monotonic_time_ms());
+		}
+		if (atomic_load_int(&slab_manager->reaper_running)) {
+			kmem_reap();
+		}
+	}
+}
+
+int kmem_reaper_start(int interval_ms) {
+
+	// Slabs are stamped with the clock as soon as the reaper counts as running
+	atomic_exchange_int(&slab_manager->reaper_clock, (int)monotonic_time_ms());
+	if (atomic_compare_exchange_int(&slab_manager->reaper_running, 0, 1) != 0) {
+		return -1;
+	}
+
+	slab_manager->reaper_interval_ms = interval_ms > REAPER_TICK_MS ? interval_ms : REAPER_TICK_MS;
+	if (thread_create(&slab_manager->reaper, reaper_work, NULL)) {
+		atomic_exchange_int(&slab_manager->reaper_running, 0);
+		return -1;
+	}
+	return 0;
+}
+
+unsigned long long kmem_reaper_stop() {
+
+	if (atomic_exchange_int(&slab_manager->reaper_running, 0)) {
+		thread_join(slab_manager->reaper);
+	}
+	return atomic_load_ull(&slab_manager->reaped_blocks);
+}
+
+unsigned long long kmem_reaped_blocks() {
+	return atomic_load_ull(&slab_manager->reaped_blocks);
+}
+
+void kmem_cache_set_reap_policy(kmem_cache_t* cachep, int warm_slabs, int idle_ms) {
+
+	if (cachep->backing) {
+		cachep = cachep->backing;
+	}
+
+	mutex_lock(&cachep->mutex);
+	cachep->reap_warm_slabs = warm_slabs > 0 ? warm_slabs : 0;
+	cachep->reap_idle_ms = idle_ms > 0 ? idle_ms : 0;
+	mutex_unlock(&cachep->mutex);
+}
+
+
+typedef struct reclaim_candidate {
+	kmem_cache_t* cache;
+	size_t blocks;		// held in empty slabs
+	size_t work_per_slab;	// releasing a slab costs one buddy free, a descriptor free off-slab and a dtor call per object
+} ReclaimCandidate;
+
+typedef struct reclaim_round {
+	ReclaimCandidate candidates[RECLAIM_MAX_CANDIDATES];
+	int count;
+} ReclaimRound;
+
+// Blocks returned per unit of work first, the caches holding the most blocks among equals
+int reclaim_candidate_better(ReclaimCandidate* first, ReclaimCandidate* second) {
+	size_t first_yield = (size_t)first->cache->slab_size_in_blocks * second->work_per_slab;
+	size_t second_yield = (size_t)second->cache->slab_size_in_blocks * first->work_per_slab;
+	if (first_yield != second_yield) {
+		return first_yield > second_yield;
+	}
+	return first->blocks > second->blocks;
+}
+
+int reclaim_candidate_compare(const void* first, const void* second) {
+	ReclaimCandidate* a = (ReclaimCandidate*)first;
+	ReclaimCandidate* b = (ReclaimCandidate*)second;
+	return reclaim_candidate_better(a, b) ? -1 : reclaim_candidate_better(b, a) ? 1 : 0;
+}
+
+void reclaim_candidate_visit(kmem_cache_t* cachep, void* arg) {
+
+	ReclaimRound* round = (ReclaimRound*)arg;
+	// The allocation retried after reclaim would grow the magazine cache again first, so releasing its slabs only
+	// hands the freed blocks back and forth, the reaper still trims it
+	if (cachep->backing || cachep == &slab_manager->magazine_cache) {
+		return;
+	}
+
+	mutex_lock(&cachep->mutex);
+	ReclaimCandidate candidate = { cachep, (size_t)cachep->empty_slab_count * cachep->slab_size_in_blocks, 1 };
+	mutex_unlock(&cachep->mutex);
+
+	if (!candidate.blocks) {
+		return;
+	}
+	candidate.work_per_slab += cachep->off_slab + (cachep->dtor ? cachep->num_of_objects_in_slab : 0);
+
+	// With more caches than slots the worst one kept so far makes room
+	if (round->count < RECLAIM_MAX_CANDIDATES) {
+		round->candidates[round->count++] = candidate;
+		return;
+	}
+	int worst = 0;
+	for (int i = 1; i < round->count; i++) {
+		if (reclaim_candidate_better(&round->candidates[worst], &round->candidates[i])) {
+			worst = i;
+		}
+	}
+	if (reclaim_candidate_better(&candidate, &round->candidates[worst])) {
+		round->candidates[worst] = candidate;
+	}
+}
+
+// Releases every empty slab, the cheapest caches first, and stops as soon as the buddy allocator has a free run
+// of blocks_wanted. main_mutex is held throughout so no cache goes away under the reclaim.
+size_t reclaim_empty_slabs(size_t blocks_wanted) {
+
+	size_t reclaimed = 0;
+	unsigned now = monotonic_time_ms();
+
+	mutex_lock(&slab_manager->main_mutex);
+	while (!buddy_has_free_run(blocks_wanted)) {
+		ReclaimRound round;
+		round.count = 0;
+		for_each_cache_locked(reclaim_candidate_visit, &round);
+		if (!round.count) {
+			break;
+		}
+
+		qsort(round.candidates, round.count, sizeof(ReclaimCandidate), reclaim_candidate_compare);
+
+		size_t round_reclaimed = 0;
+		for (int i = 0; i < round.count && !buddy_has_free_run(blocks_wanted); i++) {
+			round_reclaimed += release_empty_slabs(round.candidates[i].cache, now, 0, 0);
+		}
+		reclaimed += round_reclaimed;
+		if (!round_reclaimed) {
+			break;
+		}
+	}
+	mutex_unlock(&slab_manager->main_mutex);
+
+	return reclaimed;
+}
+
+void drain_magazines_visit(kmem_cache_t* cachep, void* arg) {
+	(void)arg;
+	if (!cachep->backing) {
+		magazine_layer_drain(cachep);
+	}
+}
+
+size_t run_shrinkers(size_t blocks_wanted) {
+
+	size_t freed = 0;
+	mutex_lock(&slab_manager->shrinker_mutex);
+	for (int i = 0; i < slab_manager->shrinker_count; i++) {
+		freed += slab_manager->shrinkers[i].shrink(blocks_wanted, slab_manager->shrinkers[i].data);
+	}
+	mutex_unlock(&slab_manager->shrinker_mutex);
+	return freed;
+}
+
+// One reclaim stage, each one more disruptive than the previous: empty slabs, then objects parked in magazines,
+// then whatever the registered shrinkers let go. Returns whether the stage freed anything worth a retry.
+// Only the public allocation entry points call this, while this thread holds no allocator lock.
+int reclaim_memory(int stage, size_t blocks_wanted) {
+
+	if (reclaim_disabled || blocks_wanted > ((size_t)1 << buddy_manager->largest_block_degree2)) {
+		return 0;
+	}
+	reclaim_disabled++;
+
+	// Cached single runs are cheap to give back and may complete a larger run
+	buddy_drain_page_caches();
+	size_t shrunk = 0;
+	if (stage == 2) {
+		shrunk = run_shrinkers(blocks_wanted);
+	}
+	// Objects the shrinkers freed mostly land in magazines, they only empty slabs once drained
+	if (stage >= 1) {
+		mutex_lock(&slab_manager->main_mutex);
+		for_each_cache_locked(drain_magazines_visit, NULL);
+		mutex_unlock(&slab_manager->main_mutex);
+	}
+	size_t reclaimed = reclaim_empty_slabs(blocks_wanted);
+	atomic_add_ull(&slab_manager->pressure_reclaimed_blocks, reclaimed);
+
+	reclaim_disabled--;
+	return reclaimed || shrunk || buddy_has_free_run(blocks_wanted);
+}
+
+int kmem_register_shrinker(kmem_shrinker_t shrink, void* data) {
+
+	int ret = -1;
+	if (slab_manager->shared) {
+		return ret;
+	}
+	mutex_lock(&slab_manager->shrinker_mutex);
+	if (slab_manager->shrinker_count < MAX_SHRINKERS) {
+		slab_manager->shrinkers[slab_manager->shrinker_count].shrink = shrink;
+		slab_manager->shrinkers[slab_manager->shrinker_count].data = data;
+		slab_manager->shrinker_count++;
+		ret = 0;
+	}
+	mutex_unlock(&slab_manager->shrinker_mutex);
+	return ret;
+}
+
+void kmem_unregister_shrinker(kmem_shrinker_t shrink, void* data) {
+
+	mutex_lock(&slab_manager->shrinker_mutex);
+	for (int i = 0; i < slab_manager->shrinker_count; i++) {
+		if (slab_manager->shrinkers[i].shrink == shrink && slab_manager->shrinkers[i].data == data) {
+			slab_manager->shrinkers[i] = slab_manager->shrinkers[--slab_manager->shrinker_count];
+			break;
+		}
+	}
+	mutex_unlock(&slab_manager->shrinker_mutex);
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// The ctest check of the cache statistics and their JSON dump, its asserts stay on in optimized builds too
+#undef NDEBUG
+#include <assert.h>
+#include "buddy.h"
+#include "slab.h"
+
+#define BLOCK_NUMBER (2048)
+#define OBJECT_SIZE (100)
+#define OBJECT_NUMBER (1000)
+#define MAX_CACHES (256)
+
+static const char cache_name[] = "stats \"test\"";	// quoted in the JSON dump
+
+static void* objects[OBJECT_NUMBER];
+
+// Returns the dump in a buffer of its own, the caller frees it
+static char* stats_json() {
+	int length = kmem_stats_json(NULL, 0);
+	assert(length > 0);
+	char* json = (char*)malloc(length + 1);
+	assert(kmem_stats_json(json, length + 1) == length);
+	assert(strlen(json) == (size_t)length);
+	return json;
+}
+
+int main() {
+
+	void* space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
+	kmem_init(space, BLOCK_NUMBER);
+
+	kmem_cache_t* cache = kmem_cache_create_flags(cache_name, OBJECT_SIZE, NULL, NULL, KMEM_CACHE_NO_MERGE);
+	kmem_cache_set_magazine_size(cache, 0);
+
+	// Objects and slabs are counted as they come and go
+	for (int i = 0; i < OBJECT_NUMBER; i++) {
+		objects[i] = kmem_cache_alloc(cache);
+		assert(objects[i]);
+	}
+	for (int i = 0; i < OBJECT_NUMBER / 4; i++) {
+		kmem_cache_free(cache, objects[i]);
+	}
+	kmem_cache_stats_t stats;
+	kmem_cache_get_stats(cache, &stats);
+	assert(!strcmp(stats.name, cache_name) && !stats.merged_into[0]);
+	assert(stats.object_size >= OBJECT_SIZE && stats.objects_per_slab > 0 && stats.slab_size_in_blocks > 0);
+	assert(stats.allocs == OBJECT_NUMBER && stats.frees == OBJECT_NUMBER / 4 && !stats.failures);
+	assert(stats.active_objects == OBJECT_NUMBER - OBJECT_NUMBER / 4);
+	unsigned long long slabs = (OBJECT_NUMBER + stats.objects_per_slab - 1) / stats.objects_per_slab;
+	assert(stats.slab_grows == slabs && stats.active_slabs == slabs && !stats.slab_shrinks);
+
+	// The snapshot covers the internal caches too and tells how many there are when it runs out of room
+	static kmem_cache_stats_t all[MAX_CACHES];
+	int count = kmem_stats_snapshot(all, MAX_CACHES);
+	assert(count > 4 && count <= MAX_CACHES);
+	assert(kmem_stats_snapshot(all, 2) == count);
+	assert(kmem_stats_snapshot(NULL, 0) == count);
+	assert(!strcmp(all[0].name, "cache_of_caches"));
+	int found = 0;
+	for (int i = 0; i < count; i++) {
+		if (!strcmp(all[i].name, cache_name)) {
+			assert(all[i].allocs == stats.allocs && all[i].active_objects == stats.active_objects);
+			found++;
+		}
+	}
+	assert(found == 1);
+
+	// Every cache and buddy order is in the dump, names escaped
+	char* json = stats_json();
+	assert(!strncmp(json, "{\"caches\":[{\"name\":\"cache_of_caches\"", strlen("{\"caches\":[{\"name\":\"cache_of_caches\"")));
+	assert(json[strlen(json) - 1] == '}');
+	char expected[256];
+	snprintf(expected, sizeof(expected), "{\"name\":\"stats \\\"test\\\"\",\"merged_into\":\"\",\"object_size\":%zu", stats.object_size);
+	assert(strstr(json, expected));
+	snprintf(expected, sizeof(expected), "\"allocs\":%llu,\"frees\":%llu,\"failures\":0,\"active_objects\":%llu",
+		stats.allocs, stats.frees, stats.active_objects);
+	assert(strstr(json, expected));
+	BuddyStats buddy_stats;
+	get_buddy_stats(&buddy_stats);
+	snprintf(expected, sizeof(expected), "\"buddy\":{\"number_of_blocks\":%zu,\"free_blocks\":%zu,\"cached_blocks\":%zu,\"number_of_shards\":%d,\"orders\":[{\"order\":0,",
+		buddy_stats.number_of_blocks, buddy_stats.free_blocks, buddy_stats.cached_blocks, buddy_stats.number_of_shards);
+	assert(strstr(json, expected));
+	snprintf(expected, sizeof(expected), "{\"order\":%d,", buddy_stats.largest_block_degree2);
+	assert(strstr(json, expected));
+
+	// Like snprintf, a short buffer gets as much as fits and the whole length comes back
+	char small[16];
+	assert(kmem_stats_json(small, sizeof(small)) == (int)strlen(json));
+	assert(strlen(small) == sizeof(small) - 1 && !strncmp(small, json, sizeof(small) - 1));
+	free(json);
+
+	// Freeing everything and shrinking gives every slab back
+	for (int i = OBJECT_NUMBER / 4; i < OBJECT_NUMBER; i++) {
+		kmem_cache_free(cache, objects[i]);
+	}
+	kmem_cache_shrink(cache);
+	kmem_cache_get_stats(cache, &stats);
+	assert(stats.frees == OBJECT_NUMBER && !stats.active_objects);
+	assert(stats.slab_shrinks == slabs && !stats.active_slabs);
+
+	kmem_cache_destroy(cache);
+	free(space);
+
+	printf("stats checks passed\n");
+	return 0;
+}